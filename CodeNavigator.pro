@@ -22,10 +22,12 @@ HEADERS += \
     LisaHighlighter.h \
     LisaCodeNavigator.h \
     LisaCodeModel.h \
+    LisaCodeIndex.h \
     FileSystem.h \
     PpLexer.h \
     LisaParser.h \
-    LisaRowCol.h
+    LisaRowCol.h \
+    FileWatcher.h
 
 SOURCES += \
     LisaLexer.cpp \
@@ -34,10 +36,12 @@ SOURCES += \
     LisaHighlighter.cpp \
     LisaCodeNavigator.cpp \
     LisaCodeModel.cpp \
+    LisaCodeIndex.cpp \
     FileSystem.cpp \
     PpLexer.cpp \
     LisaParser.cpp \
-    LisaToken.cpp
+    LisaToken.cpp \
+    FileWatcher.cpp
 
 RESOURCES += \
     CodeNavigator.qrc
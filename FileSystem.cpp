@@ -17,13 +17,147 @@
 #include "FileSystem.h"
 #include "Converter.h"
 #include "LisaLexer.h"
+#include <QBuffer>
+#include <QDataStream>
+#include <QDateTime>
 #include <QFile>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QVector>
 #include <QtDebug>
+#include <QtEndian>
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
 using namespace Lisa;
 
-FileSystem::FileSystem(QObject *parent) : QObject(parent)
+struct FileScan
+{
+    QByteArray d_moduleName;
+    QByteArrayList d_uses;
+    qint64 d_size;
+    qint64 d_mtime;
+    quint8 d_type;
+    bool d_openError;
+    FileScan():d_size(0),d_mtime(0),d_type(FileSystem::UnknownFile),d_openError(false){}
+};
+
+typedef QHash<QString,FileScan> ScanCache; // relative path -> scan
+
+static const quint32 s_cacheMagic = 0x4c504643; // LPFC
+static const quint32 s_cacheVersion = 4;
+
+static QString cachePath(const QString& rootDir)
+{
+    return QDir::cleanPath(rootDir) + ".lpcache";
+}
+
+static void readCache(const QString& path, ScanCache& cache)
+{
+    QFile f(path);
+    if( !f.open(QIODevice::ReadOnly) )
+        return;
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_5_0);
+    quint32 magic, version, count;
+    in >> magic >> version >> count;
+    if( magic != s_cacheMagic || version != s_cacheVersion )
+        return;
+    for( quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++ )
+    {
+        QString rel;
+        FileScan scan;
+        in >> rel >> scan.d_size >> scan.d_mtime >> scan.d_type >> scan.d_moduleName >> scan.d_uses;
+        cache.insert(rel,scan);
+    }
+    if( in.status() != QDataStream::Ok )
+        cache.clear();
+}
+
+static void writeCache(const QString& path, const QStringList& files, const QVector<FileScan>& scans, int off)
+{
+    QFile f(path);
+    if( !f.open(QIODevice::WriteOnly) )
+        return; // the cache is optional
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_5_0);
+    quint32 count = 0;
+    for( int i = 0; i < scans.size(); i++ )
+        if( !scans[i].d_openError )
+            count++;
+    out << s_cacheMagic << s_cacheVersion << count;
+    for( int i = 0; i < files.size(); i++ )
+    {
+        const FileScan& scan = scans[i];
+        if( scan.d_openError )
+            continue;
+        out << files[i].mid(off+1) << scan.d_size << scan.d_mtime << scan.d_type << scan.d_moduleName << scan.d_uses;
+    }
+}
+
+class ClassifyJob : public QRunnable
+{
+public:
+    enum { PrefixLen = 8 * 1024, ChunkLen = 16 };
+    ClassifyJob(const QStringList& files, FileScan* res, const QVector<int>& todo, int from, int to):
+        d_files(files),d_res(res),d_todo(todo),d_from(from),d_to(to){}
+    void run()
+    {
+        for( int i = d_from; i < d_to; i++ )
+            classify(d_files[d_todo[i]], d_res[d_todo[i]]);
+    }
+    static void classify(const QString& path, FileScan& res)
+    {
+        QFile in(path);
+        if( !in.open(QIODevice::ReadOnly) )
+        {
+            res.d_openError = true;
+            return;
+        }
+        // the type is usually decided by the first token, so only look at the beginning of the file
+        QByteArray prefix = in.read(PrefixLen);
+        QBuffer buf(&prefix);
+        buf.open(QIODevice::ReadOnly);
+        res.d_type = FileSystem::detectType(&buf,&res.d_moduleName,&res.d_uses);
+        if( buf.atEnd() && !in.atEnd() )
+        {
+            res.d_moduleName.clear();
+            res.d_uses.clear();
+            res.d_type = FileSystem::detectType(&in,&res.d_moduleName,&res.d_uses);
+        }
+        // the content hash is computed when the file is read for parsing, see getHash
+    }
+private:
+    const QStringList& d_files;
+    FileScan* d_res;
+    const QVector<int>& d_todo;
+    int d_from, d_to;
+};
+
+namespace Lisa
+{
+class ReadAheadJob : public QRunnable
+{
+public:
+    enum { BatchLen = 8 };
+    ReadAheadJob(const FileSystem* fs, const QList<const FileSystem::File*>& files):d_fs(fs),d_files(files){}
+    void run() { d_fs->readAhead(d_files); }
+private:
+    const FileSystem* d_fs;
+    QList<const FileSystem::File*> d_files;
+};
+}
+
+FileSystem::FileSystem(QObject *parent) : QObject(parent),d_useCache(true),d_archive(0),d_map(0),
+    d_includeHits(0),d_includeMisses(0),d_lookupLock(QMutex::Recursive)
 {
+    d_ioPool = new QThreadPool(this);
+    d_ioPool->setMaxThreadCount(4);
+}
 
+FileSystem::~FileSystem()
+{
+    clear();
 }
 
 static QString oneUp(const QString& path)
@@ -61,85 +195,81 @@ static QStringList collectFiles( const QDir& dir, const QStringList& suffix )
     return res;
 }
 
+void FileSystem::clear()
+{
+    d_ioPool->clear();
+    d_ioPool->waitForDone();
+    d_root.clear();
+    d_fileMap.clear();
+    d_files.clear();
+    d_moduleMap.clear();
+    d_fileCache.clear();
+    d_moduleCache.clear();
+    d_includeCache.clear();
+    d_contentCache.clear();
+    d_includeHits = 0;
+    d_includeMisses = 0;
+    if( d_archive )
+        delete d_archive; // also unmaps
+    d_archive = 0;
+    d_map = 0;
+}
+
 bool FileSystem::load(const QString& rootDir)
 {
+    if( isArchive(rootDir) )
+        return loadArchive(rootDir);
     if( !QFileInfo(rootDir).isDir() )
         return error("not a directory");
 
-    d_root.clear();
-    d_fileMap.clear();
-    d_moduleMap.clear();
+    clear();
+    d_rootDir = rootDir;
 
     const QStringList files = collectFiles(rootDir,QStringList() << "*.txt");
     const int off = rootDir.size();
 
-    foreach( const QString& f, files )
+    // files with unchanged size and mtime take their type from the cache of the previous run
+    ScanCache cache;
+    if( d_useCache )
+        readCache(cachePath(rootDir), cache);
+    QVector<FileScan> scans(files.size());
+    QVector<int> todo;
+    for( int i = 0; i < files.size(); i++ )
     {
-        QFile in(f);
-        if( !in.open(QIODevice::ReadOnly) )
-            return error(tr("cannot open file for reading: %1").arg(f));
-        QByteArray moduleName;
-        const FileType fileType = detectType(&in,&moduleName);
-        if( fileType == UnknownFile )
-            continue;
-        in.close();
+        QFileInfo info(files[i]);
+        const qint64 size = info.size();
+        const qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+        ScanCache::const_iterator hit = cache.find(files[i].mid(off+1));
+        if( hit != cache.end() && hit.value().d_size == size && hit.value().d_mtime == mtime )
+            scans[i] = hit.value();
+        else
+        {
+            scans[i].d_size = size;
+            scans[i].d_mtime = mtime;
+            todo.append(i);
+        }
+    }
 
-        QFileInfo info(f);
+    // classify in parallel, then merge in file order so the result is the same as a serial run
+    QThreadPool pool;
+    for( int i = 0; i < todo.size(); i += ClassifyJob::ChunkLen )
+        pool.start(new ClassifyJob(files, scans.data(), todo, i, qMin(i + int(ClassifyJob::ChunkLen), todo.size())));
+    pool.waitForDone();
 
-        const QString relDirPath = info.absolutePath().mid(off+1);
-        const QString fileName = info.fileName().toLower();
+    if( d_useCache && ( !todo.isEmpty() || cache.size() != files.size() ) )
+        writeCache(cachePath(rootDir), files, scans, off);
 
-        QString name;
-        if( fileName.endsWith("text.unix.txt") )
-        {
-            name = fileName;
-            name.chop(14); // including dot
-        }else
-            name = info.baseName();
-
-        QStringList parts = name.contains('-') ? name.split('-') : name.split('.');
-
-        File* file = new File();
-        file->d_type = fileType;
-        file->d_name = name;
-        file->d_moduleName = moduleName;
-        file->d_moduleLc = moduleName.toLower();
-        if( !file->d_moduleLc.isEmpty() )
-        {
-            File*& slot = d_moduleMap[file->d_moduleLc];
-            if( slot == 0 )
-                slot = file;
-            else
-            {
-                if( ( slot->d_moduleLc != slot->d_name && file->d_moduleLc == file->d_name)
-                      // prefer modules where name corresponds to file name
-                        || ( slot->level() < file->level() )
-                             // prefer modules deeper in the hierarchy
-                        )
-                {
-                    slot->d_doublette = true;
-                    slot = file;
-                }else
-                    file->d_doublette = true;
-            }
-        }
-        file->d_realPath = f;
-        d_fileMap[f] = file;
-        if( parts.size() == 1 )
-        {
-            // file with no dir
-            Dir* dir = getDir(relDirPath);
-            file->d_dir = dir;
-            dir->d_files.append(file);
-        }else if( parts.size() >= 2 )
-        {
-            Dir* dir = getDir(replaceLast(relDirPath,parts.front()));
-            parts.pop_front();
-            file->d_name = parts.join('_');
-            file->d_dir = dir;
-            dir->d_files.append(file);
-        }
+    for( int i = 0; i < files.size(); i++ )
+    {
+        const QString& f = files[i];
+        if( scans[i].d_openError )
+            return error(tr("cannot open file for reading: %1").arg(f));
+        const FileType fileType = (FileType)scans[i].d_type;
+        if( fileType == UnknownFile )
+            continue;
+        addFile(f, off, fileType, scans[i].d_moduleName)->d_uses = scans[i].d_uses;
     }
+    d_contentCache.resize(d_files.size());
 
 #if 0
     // print stats
@@ -160,6 +290,78 @@ bool FileSystem::load(const QString& rootDir)
     return true;
 }
 
+FileSystem::File*FileSystem::addFile(const QString& f, int off, FileSystem::FileType fileType,
+                                     const QByteArray& moduleName)
+{
+    QFileInfo info(f);
+
+    const QString relDirPath = info.absolutePath().mid(off+1);
+    const QString fileName = info.fileName().toLower();
+
+    QString name;
+    if( fileName.endsWith("text.unix.txt") )
+    {
+        name = fileName;
+        name.chop(14); // including dot
+    }else
+        name = info.baseName();
+
+    QStringList parts = name.contains('-') ? name.split('-') : name.split('.');
+
+    File* file = new File();
+    file->d_id = d_files.size();
+    d_files.append(file);
+    file->d_type = fileType;
+    file->d_name = name;
+    file->d_moduleName = moduleName;
+    file->d_moduleLc = moduleName.toLower();
+    if( !file->d_moduleLc.isEmpty() )
+    {
+        File*& slot = d_moduleMap[file->d_moduleLc];
+        if( slot == 0 )
+            slot = file;
+        else
+        {
+            if( ( slot->d_moduleLc != slot->d_name && file->d_moduleLc == file->d_name)
+                  // prefer modules where name corresponds to file name
+                    || ( slot->level() < file->level() )
+                         // prefer modules deeper in the hierarchy
+                    )
+            {
+                slot->d_doublette = true;
+                slot = file;
+            }else
+                file->d_doublette = true;
+        }
+    }
+    file->d_realPath = f;
+    d_fileMap[f] = file;
+    if( parts.size() == 1 )
+    {
+        // file with no dir
+        Dir* dir = getDir(relDirPath);
+        file->d_dir = dir;
+        dir->addFile(file);
+    }else if( parts.size() >= 2 )
+    {
+        Dir* dir = getDir(replaceLast(relDirPath,parts.front()));
+        parts.pop_front();
+        file->d_name = parts.join('_');
+        file->d_dir = dir;
+        dir->addFile(file);
+    }
+    // d_level stays 0 up to here, so the doublette resolution above compares the new file as level 0
+    const Dir* d = file->d_dir;
+    while( d && !d->d_name.isEmpty() )
+    {
+        file->d_level++;
+        file->d_virtualPath = d->d_name + "/" + file->d_virtualPath;
+        d = d->d_dir;
+    }
+    file->d_virtualPath += file->d_name;
+    return file;
+}
+
 static void walkForPas(const FileSystem::Dir* d, QList<const FileSystem::File*>& res )
 {
     for( int i = 0; i < d->d_subdirs.size(); i++ )
@@ -184,26 +386,47 @@ const FileSystem::File*FileSystem::findFile(const QString& realPath) const
 const FileSystem::File*FileSystem::findFile(const Dir* startFrom, const QString& dir, const QString& name) const
 {
     Q_ASSERT(startFrom);
+    QMutexLocker lock(&d_lookupLock);
+    const DirKey key(startFrom, dir.isEmpty() ? name : dir + '/' + name);
+    QHash<DirKey,const File*>::const_iterator i = d_fileCache.find(key);
+    if( i != d_fileCache.end() )
+        return i.value();
     const File* res = 0;
     const Dir* d = startFrom;
-    if( res == 0 && d )
+    while( res == 0 && d )
     {
         if( dir.isEmpty() || d->d_name == dir )
             res = d->file(name);
+        else
+        {
+            const Dir* sub = d->subdir(dir);
+            if( sub )
+                res = sub->file(name);
+        }
         d = d->d_dir;
     }
+    d_fileCache.insert(key,res);
     return res;
 }
 
 const FileSystem::File*FileSystem::findModule(const FileSystem::Dir* startFrom, const QByteArray& nameLc) const
 {
     Q_ASSERT(startFrom);
+    QMutexLocker lock(&d_lookupLock);
+    const QPair<const Dir*,QByteArray> key(startFrom,nameLc);
+    QHash<QPair<const Dir*,QByteArray>,const File*>::const_iterator i = d_moduleCache.find(key);
     const File* res = 0;
-    const Dir* d = startFrom;
-    if( res == 0 && d )
+    if( i != d_moduleCache.end() )
+        res = i.value();
+    else
     {
-        res = d->module(nameLc);
-        d = d->d_dir;
+        const Dir* d = startFrom;
+        while( res == 0 && d )
+        {
+            res = d->module(nameLc);
+            d = d->d_dir;
+        }
+        d_moduleCache.insert(key,res);
     }
     if( res == 0 )
     {
@@ -228,7 +451,373 @@ const FileSystem::File*FileSystem::findModule(const FileSystem::Dir* startFrom,
     return res;
 }
 
-FileSystem::FileType FileSystem::detectType(QIODevice* in, QByteArray* name)
+static const char s_archiveMagic[] = "LPAR";
+static const int s_archiveHeaderLen = 16;
+static const quint32 s_archiveVersion = 2;
+
+bool FileSystem::isArchive(const QString& path)
+{
+    QFile in(path);
+    if( !QFileInfo(path).isFile() || !in.open(QIODevice::ReadOnly) )
+        return false;
+    return in.read(4) == QByteArray(s_archiveMagic);
+}
+
+bool FileSystem::isSourceFile(const QString& path)
+{
+    // the same suffix and type checks as load
+    if( !path.endsWith(".txt", Qt::CaseInsensitive) )
+        return false;
+    FileScan scan;
+    ClassifyJob::classify(path, scan);
+    return !scan.d_openError && scan.d_type != UnknownFile;
+}
+
+bool FileSystem::writeArchive(const QString& path) const
+{
+    // header: "LPAR", u32 version, u32 file count, u32 offset of index; then the file contents;
+    // index: per file u32 offset, u32 length, u8 type, u16 length + utf8 path relative to the root,
+    // u16 length + module name, u16 number of used modules, each u16 length + name; all numbers little endian
+    QFile out(path);
+    if( !out.open(QIODevice::WriteOnly) )
+        return false;
+    QByteArray header(s_archiveHeaderLen, 0);
+    out.write(header);
+    QByteArray index;
+    const int off = d_rootDir.size();
+    uchar num[4];
+    foreach( const File* f, d_files )
+    {
+        const QByteArray content = getContent(f);
+        if( content.isNull() )
+            return false;
+        qToLittleEndian<quint32>(out.pos(), num);
+        index.append((const char*)num, 4);
+        qToLittleEndian<quint32>(content.size(), num);
+        index.append((const char*)num, 4);
+        index.append(char(f->d_type));
+        const QByteArray rel = f->d_realPath.mid(off+1).toUtf8();
+        qToLittleEndian<quint16>(rel.size(), num);
+        index.append((const char*)num, 2);
+        index.append(rel);
+        const QByteArray mod = f->d_moduleName.toUtf8();
+        qToLittleEndian<quint16>(mod.size(), num);
+        index.append((const char*)num, 2);
+        index.append(mod);
+        qToLittleEndian<quint16>(f->d_uses.size(), num);
+        index.append((const char*)num, 2);
+        foreach( const QByteArray& use, f->d_uses )
+        {
+            qToLittleEndian<quint16>(use.size(), num);
+            index.append((const char*)num, 2);
+            index.append(use);
+        }
+        if( out.write(content) != content.size() )
+            return false;
+    }
+    ::memcpy(header.data(), s_archiveMagic, 4);
+    qToLittleEndian<quint32>(s_archiveVersion, (uchar*)header.data() + 4);
+    qToLittleEndian<quint32>(d_files.size(), (uchar*)header.data() + 8);
+    qToLittleEndian<quint32>(out.pos(), (uchar*)header.data() + 12);
+    return out.write(index) == index.size() && out.seek(0) && out.write(header) == header.size();
+}
+
+bool FileSystem::loadArchive(const QString& path)
+{
+    clear();
+    d_rootDir = path;
+    d_archive = new QFile(path);
+    if( !d_archive->open(QIODevice::ReadOnly) )
+        return error(tr("cannot open archive %1").arg(path));
+    const qint64 size = d_archive->size();
+    if( size < s_archiveHeaderLen || ( d_map = d_archive->map(0, size) ) == 0 )
+        return error(tr("cannot map archive %1").arg(path));
+    if( qFromLittleEndian<quint32>(d_map + 4) != s_archiveVersion )
+        return error(tr("incompatible archive version %1").arg(path));
+    const quint32 count = qFromLittleEndian<quint32>(d_map + 8);
+    const uchar* p = d_map + qFromLittleEndian<quint32>(d_map + 12);
+    const uchar* end = d_map + size;
+    const int off = path.size();
+    d_slices.resize(count);
+    for( quint32 i = 0; i < count; i++ )
+    {
+        if( p + 11 > end )
+            return error(tr("invalid archive index %1").arg(path));
+        const quint32 pos = qFromLittleEndian<quint32>(p);
+        const quint32 len = qFromLittleEndian<quint32>(p + 4);
+        const quint8 type = p[8];
+        const quint16 relLen = qFromLittleEndian<quint16>(p + 9);
+        p += 11;
+        if( p + relLen + 2 > end || quint64(pos) + len > quint64(size) )
+            return error(tr("invalid archive index %1").arg(path));
+        const QString rel = QString::fromUtf8((const char*)p, relLen);
+        p += relLen;
+        const quint16 modLen = qFromLittleEndian<quint16>(p);
+        p += 2;
+        if( p + modLen > end )
+            return error(tr("invalid archive index %1").arg(path));
+        const QByteArray mod((const char*)p, modLen);
+        p += modLen;
+        if( p + 2 > end )
+            return error(tr("invalid archive index %1").arg(path));
+        QByteArrayList uses;
+        const quint16 useCount = qFromLittleEndian<quint16>(p);
+        p += 2;
+        for( int j = 0; j < useCount; j++ )
+        {
+            if( p + 2 > end || p + 2 + qFromLittleEndian<quint16>(p) > end )
+                return error(tr("invalid archive index %1").arg(path));
+            const quint16 len = qFromLittleEndian<quint16>(p);
+            uses.append(QByteArray((const char*)p + 2, len));
+            p += 2 + len;
+        }
+        // files were written in load order, so doublette resolution gives the same result
+        addFile(path + "/" + rel, off, (FileType)type, mod)->d_uses = uses;
+        d_slices[i] = qMakePair(pos,len);
+    }
+    return true;
+}
+
+QByteArray FileSystem::getContent(const FileSystem::File* f) const
+{
+    Q_ASSERT(f);
+    if( d_map )
+    {
+        if( f->d_id >= quint32(d_slices.size()) )
+            return QByteArray();
+        const QPair<quint32,quint32>& s = d_slices[f->d_id];
+        QByteArray res = QByteArray::fromRawData((const char*)d_map + s.first, s.second);
+        if( res.isNull() )
+            res = QByteArray("");
+        return res;
+    }
+
+    QMutexLocker lock(&d_contentLock);
+    while( d_reading.contains(f->d_id) )
+        d_contentRead.wait(&d_contentLock);
+    if( f->d_id < quint32(d_contentCache.size()) && !d_contentCache[f->d_id].isNull() )
+        return d_contentCache[f->d_id];
+    lock.unlock();
+
+    QFile in(f->d_realPath);
+    if( !in.open(QIODevice::ReadOnly) )
+        return QByteArray();
+    QByteArray res = in.readAll();
+    if( res.isNull() )
+        res = QByteArray(""); // empty but readable
+    lock.relock();
+    if( f->d_id < quint32(d_contentCache.size()) )
+        d_contentCache[f->d_id] = res;
+    return res;
+}
+
+bool FileSystem::refresh(const FileSystem::File* f)
+{
+    Q_ASSERT(f);
+    if( d_map )
+        return false; // archives don't change
+    QMutexLocker lock(&d_contentLock);
+    while( d_reading.contains(f->d_id) )
+        d_contentRead.wait(&d_contentLock);
+    if( f->d_id < quint32(d_contentCache.size()) )
+        d_contentCache[f->d_id] = QByteArray();
+    const_cast<File*>(f)->d_hash = 0; // getHash computes it from the new content
+    lock.unlock();
+
+    QByteArray content = getContent(f);
+    if( content.isNull() )
+        return false; // no longer readable
+    QBuffer buf(&content);
+    buf.open(QIODevice::ReadOnly);
+    QByteArray name;
+    QByteArrayList uses;
+    const FileType t = detectType(&buf,&name,&uses);
+    if( t != f->d_type || name.toLower() != f->d_moduleLc )
+        return false; // the indexes built by load depend on these
+    File* file = const_cast<File*>(f);
+    file->d_uses = uses;
+    return true;
+}
+
+void FileSystem::prefetch(const QList<const FileSystem::File*>& files) const
+{
+    if( d_map )
+        return; // the archive is already mapped
+    for( int i = 0; i < files.size(); i += ReadAheadJob::BatchLen )
+        d_ioPool->start(new ReadAheadJob(this, files.mid(i, ReadAheadJob::BatchLen)));
+}
+
+void FileSystem::readAhead(const QList<const FileSystem::File*>& batch) const
+{
+    QList<const File*> todo;
+    QMutexLocker lock(&d_contentLock);
+    foreach( const File* f, batch )
+    {
+        if( f->d_id < quint32(d_contentCache.size()) && d_contentCache[f->d_id].isNull() &&
+                !d_reading.contains(f->d_id) )
+        {
+            d_reading.insert(f->d_id);
+            todo.append(f);
+        }
+    }
+    lock.unlock();
+
+    // open all files of the batch and tell the kernel about them before reading the first one
+    QList<QFile*> files;
+    foreach( const File* f, todo )
+    {
+        QFile* in = new QFile(f->d_realPath);
+        if( in->open(QIODevice::ReadOnly) )
+        {
+#ifdef Q_OS_LINUX
+            ::posix_fadvise(in->handle(), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        }
+        files.append(in);
+    }
+    for( int i = 0; i < todo.size(); i++ )
+    {
+        QByteArray content;
+        if( files[i]->isOpen() )
+        {
+            content = files[i]->readAll();
+            if( content.isNull() )
+                content = QByteArray("");
+        }
+        delete files[i];
+        // hash here in the background, so getHash usually finds it done
+        const quint64 hash = !content.isNull() && hasHash(todo[i]) ?
+                    hashContent(content.constData(), content.size()) : 0;
+        lock.relock();
+        // a failed read stays null so getContent tries again and reports it
+        d_contentCache[todo[i]->d_id] = content;
+        if( hash )
+            const_cast<File*>(todo[i])->d_hash = hash;
+        d_reading.remove(todo[i]->d_id);
+        d_contentRead.wakeAll();
+        lock.unlock();
+    }
+}
+
+bool FileSystem::hasHash(const FileSystem::File* f)
+{
+    // only units and programs are compared by content
+    return f->d_type == PascalProgram || f->d_type == PascalUnit;
+}
+
+quint64 FileSystem::getHash(const FileSystem::File* f) const
+{
+    Q_ASSERT(f);
+    if( !hasHash(f) )
+        return 0;
+    QMutexLocker lock(&d_contentLock);
+    if( f->d_hash )
+        return f->d_hash;
+    lock.unlock();
+    const QByteArray content = getContent(f);
+    if( content.isNull() )
+        return 0;
+    const quint64 hash = hashContent(content.constData(), content.size());
+    lock.relock();
+    const_cast<File*>(f)->d_hash = hash;
+    return hash;
+}
+
+QIODevice*FileSystem::openFile(const FileSystem::File* f) const
+{
+    Q_ASSERT(f);
+    const QByteArray content = getContent(f);
+    if( content.isNull() )
+        return 0;
+    QBuffer* buf = new QBuffer();
+    buf->setData(content);
+    buf->open(QIODevice::ReadOnly);
+    return buf;
+}
+
+const FileSystem::File*FileSystem::findInclude(const FileSystem::Dir* from, const QByteArray& directive, QByteArray* content) const
+{
+    Q_ASSERT(from);
+    QMutexLocker lock(&d_lookupLock);
+    const QPair<const Dir*,QByteArray> key(from,directive);
+    QHash<QPair<const Dir*,QByteArray>,const File*>::const_iterator i = d_includeCache.find(key);
+    const File* res = 0;
+    if( i != d_includeCache.end() )
+    {
+        d_includeHits++;
+        res = i.value();
+    }else
+    {
+        d_includeMisses++;
+        QString path = QString::fromUtf8(directive).trimmed().toLower();
+        if( path.endsWith(".text") )
+            path.chop(5);
+        const QStringList pathFile = path.split('/');
+        if( pathFile.size() == 1 )
+        {
+            QString name = pathFile[0];
+            const int colon = name.indexOf(':');
+            if( colon != -1 )
+                name = name.mid(colon+1);
+            res = findFile(from, QString(), name);
+        }else if( pathFile.size() == 2 )
+            res = findFile(from, pathFile[0], pathFile[1]);
+        d_includeCache.insert(key,res);
+    }
+    lock.unlock();
+    if( res && content )
+        *content = getContent(res);
+    return res;
+}
+
+static void scanUses(Lexer& lex, QByteArrayList& res)
+{
+    Token t = lex.nextToken();
+    while( t.isValid() )
+    {
+        switch( t.d_type )
+        {
+        case Tok_uses:
+            t = lex.nextToken();
+            while( t.isValid() && t.d_type != Tok_Semi )
+            {
+                if( t.d_type == Tok_Comma )
+                {
+                    t = lex.nextToken();
+                    continue;
+                }
+                if( t.d_type == Tok_identifier )
+                {
+                    const QByteArray id = t.d_val;
+                    t = lex.nextToken();
+                    if( t.d_type == Tok_Slash )
+                    {
+                        t = lex.nextToken();
+                        if( t.d_type == Tok_identifier ) // just to make sure
+                        {
+                            res.append( t.d_val );
+                            t = lex.nextToken();
+                        }
+                    }else
+                        res.append(id);
+                }else
+                    t = lex.nextToken();
+            }
+            return;
+        case Tok_label:
+        case Tok_var:
+        case Tok_const:
+        case Tok_type:
+        case Tok_procedure:
+        case Tok_function:
+        case Tok_implementation:
+            return;
+        }
+        t = lex.nextToken();
+    }
+}
+
+FileSystem::FileType FileSystem::detectType(QIODevice* in, QByteArray* name, QByteArrayList* uses)
 {
     Q_ASSERT(in);
     in->reset();
@@ -253,6 +842,11 @@ FileSystem::FileType FileSystem::detectType(QIODevice* in, QByteArray* name)
                 if( t.d_type == Tok_identifier )
                     *name = t.d_val;
             }
+            if( uses )
+            {
+                lex.setIgnoreComments(true);
+                scanUses(lex, *uses);
+            }
             return PascalProgram;
         case Tok_unit:
             if( name )
@@ -262,6 +856,11 @@ FileSystem::FileType FileSystem::detectType(QIODevice* in, QByteArray* name)
                 if( t.d_type == Tok_identifier )
                     *name = t.d_val;
             }
+            if( uses )
+            {
+                lex.setIgnoreComments(true);
+                scanUses(lex, *uses);
+            }
             return PascalUnit;
         case Tok_function:
         case Tok_procedure:
@@ -280,6 +879,16 @@ FileSystem::FileType FileSystem::detectType(QIODevice* in, QByteArray* name)
     return res;
 }
 
+quint64 FileSystem::hashContent(const char* data, int len, quint64 h)
+{
+    for( int i = 0; i < len; i++ )
+    {
+        h ^= quint8(data[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
 bool FileSystem::error(const QString& msg)
 {
     d_error = msg;
@@ -298,8 +907,7 @@ FileSystem::Dir*FileSystem::getDir(const QString& relPath)
         {
             res = new Dir();
             res->d_name = segs[i];
-            cur->d_subdirs.append(res);
-            res->d_dir = cur;
+            cur->addSubdir(res);
         }
         cur = res;
     }
@@ -314,6 +922,9 @@ void FileSystem::Dir::clear()
     for( int i = 0; i < d_files.size(); i++ )
         delete d_files[i];
     d_files.clear();
+    d_subdirIdx.clear();
+    d_fileIdx.clear();
+    d_moduleIdx.clear();
 }
 
 static const char* typeName(int t)
@@ -343,53 +954,27 @@ void FileSystem::Dir::dump(int level) const
         d_subdirs[i]->dump(level+1);
 }
 
-FileSystem::Dir*FileSystem::Dir::subdir(const QString& name) const
-{
-    for(int i = 0; i < d_subdirs.size(); i++ )
-        if( d_subdirs[i]->d_name == name )
-            return d_subdirs[i];
-    return 0;
-}
-
-const FileSystem::File*FileSystem::Dir::file(const QString& name) const
+void FileSystem::Dir::addSubdir(FileSystem::Dir* sub)
 {
-    for(int i = 0; i < d_files.size(); i++ )
-        if( d_files[i]->d_name == name )
-            return d_files[i];
-    return 0;
+    sub->d_dir = this;
+    d_subdirs.append(sub);
+    if( !d_subdirIdx.contains(sub->d_name) )
+        d_subdirIdx.insert(sub->d_name,sub);
 }
 
-const FileSystem::File*FileSystem::Dir::module(const QByteArray& nameLc) const
+void FileSystem::Dir::addFile(FileSystem::File* f)
 {
-    for(int i = 0; i < d_files.size(); i++ )
-        if( d_files[i]->d_moduleLc == nameLc )
-            return d_files[i];
-    return 0;
+    d_files.append(f);
+    if( !d_fileIdx.contains(f->d_name) )
+        d_fileIdx.insert(f->d_name,f);
+    if( !d_moduleIdx.contains(f->d_moduleLc) )
+        d_moduleIdx.insert(f->d_moduleLc,f);
 }
 
 QString FileSystem::File::getVirtualPath(bool suffix) const
 {
-    const Dir* d = d_dir;
-    QString res;
-    while( d && !d->d_name.isEmpty() )
-    {
-        res = d->d_name + "/" + res;
-        d = d->d_dir;
-    }
-    res += d_name;
     if( suffix )
-        res += typeName(d_type);
-    return res;
-}
-
-int FileSystem::File::level() const
-{
-    int res = 0;
-    const Dir* d = d_dir;
-    while( d && !d->d_name.isEmpty() )
-    {
-        res++;
-        d = d->d_dir;
-    }
-    return res;
+        return d_virtualPath + typeName(d_type);
+    else
+        return d_virtualPath;
 }
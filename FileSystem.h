@@ -17,10 +17,18 @@
 ** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
 */
 
+#include <QByteArrayList>
 #include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QVector>
+#include <QWaitCondition>
 #include <QObject>
 
 class QIODevice;
+class QFile;
+class QThreadPool;
 
 namespace Lisa
 {
@@ -35,13 +43,19 @@ public:
         QList<File*> d_files;
         QString d_name;
         Dir* d_dir;
+        // indexes over d_subdirs and d_files; the first entry with a given name wins
+        QHash<QString,Dir*> d_subdirIdx;
+        QHash<QString,File*> d_fileIdx;
+        QHash<QByteArray,File*> d_moduleIdx;
 
         void clear();
         void dump(int level = 0) const;
-        Dir* subdir(const QString& name) const;
-        const File* file(const QString& name) const;
-        const File* module(const QByteArray& nameLc) const;
-        Dir() {}
+        void addSubdir(Dir*);
+        void addFile(File*);
+        Dir* subdir(const QString& name) const { return d_subdirIdx.value(name); }
+        const File* file(const QString& name) const { return d_fileIdx.value(name); }
+        const File* module(const QByteArray& nameLc) const { return d_moduleIdx.value(nameLc); }
+        Dir():d_dir(0) {}
         ~Dir() { clear(); }
     };
 
@@ -52,38 +66,87 @@ public:
         bool d_doublette;
         bool d_forceParse;
         bool d_parsed;
+        quint16 d_level; // number of named dirs above this file
+        quint32 d_id; // dense index, see getFile()
+        quint64 d_hash; // of the content, only for programs and units; 0 until read, use getHash
         QString d_realPath;
         QString d_name; // fileName
+        QString d_virtualPath; // without suffix
         QString d_moduleName;
         QByteArray d_moduleLc; // lower-case version
+        QByteArrayList d_uses; // module names in the uses clause
         Dir* d_dir;
         QString getVirtualPath(bool suffix = true) const;
-        int level() const;
+        int level() const { return d_level; }
 
-        File():d_doublette(false),d_type(UnknownFile),d_dir(0),d_forceParse(false),d_parsed(false){}
+        File():d_doublette(false),d_type(UnknownFile),d_dir(0),d_forceParse(false),d_parsed(false),
+            d_level(0),d_id(0),d_hash(0){}
     };
 
     explicit FileSystem(QObject *parent = 0);
-    bool load( const QString& rootDir );
+    ~FileSystem();
+    bool load( const QString& rootDir ); // rootDir can also be an archive written by writeArchive
+    void setUseCache(bool on) { d_useCache = on; } // keep the scan result in <rootDir>.lpcache
     const QString& getError() const { return d_error; }
     const Dir& getRoot() const { return d_root; }
     const QString& getRootPath() const { return d_rootDir; }
     QList<const File*> getAllPas() const;
     const File* findFile(const QString& realPath) const;
+    const File* getFile(quint32 id) const { return id < quint32(d_files.size()) ? d_files[id] : 0; }
+    int getFileCount() const { return d_files.size(); }
     const File* findFile(const Dir* startFrom, const QString& dir, const QString& name) const;
     const File* findModule(const Dir* startFrom, const QByteArray& nameLc) const;
+    // resolve the argument of a $I directive as seen from dir; content is the cached file content
+    const File* findInclude(const Dir* from, const QByteArray& directive, QByteArray* content = 0) const;
+    quint32 getIncludeHits() const { return d_includeHits; }
+    quint32 getIncludeMisses() const { return d_includeMisses; }
 
-    static FileType detectType(QIODevice* in, QByteArray* = 0);
+    // single file with the content and metadata of all loaded files, mapped as a whole by load
+    bool writeArchive( const QString& path ) const;
+    static bool isArchive( const QString& path );
+    static bool isSourceFile( const QString& path ); // a file load would pick up
+    bool isArchive() const { return d_map != 0; }
+    QByteArray getContent( const File* ) const; // refers to the mapped archive if any, valid until the next load
+    QIODevice* openFile( const File* ) const; // caller owns, 0 if not readable
+    void prefetch( const QList<const File*>& ) const; // read the files in the background in the given order
+    bool refresh( const File* ); // re-read a file changed on disk; false if only a new load can reflect the change
+    quint64 getHash( const File* ) const; // content hash of programs and units, reads the file if not yet done; thread-safe
+
+    static FileType detectType(QIODevice* in, QByteArray* name = 0, QByteArrayList* uses = 0);
+    static quint64 hashContent(const char* data, int len, quint64 h = 14695981039346656037ULL); // FNV-1a
 protected:
     bool error( const QString& );
     Dir* getDir( const QString& relPath );
+    void clear();
+    void readAhead( const QList<const File*>& ) const;
+    friend class ReadAheadJob;
+    File* addFile( const QString& realPath, int off, FileType, const QByteArray& moduleName );
+    static bool hasHash( const File* );
+    bool loadArchive( const QString& path );
 
 private:
     QString d_rootDir;
     QString d_error;
+    bool d_useCache;
     Dir d_root;
     QHash<QString,File*> d_fileMap;
+    QVector<File*> d_files; // File::d_id -> File
+    QFile* d_archive;
+    const uchar* d_map;
+    QVector<QPair<quint32,quint32> > d_slices; // File::d_id -> offset and length in d_map
     QHash<QByteArray,File*> d_moduleMap; // module to File* is ambig, but besides "prmgr" (nearly) identical
+    typedef QPair<const Dir*,QString> DirKey;
+    mutable QHash<DirKey,const File*> d_fileCache; // (startFrom, dir/name) -> result of findFile
+    mutable QHash<QPair<const Dir*,QByteArray>,const File*> d_moduleCache; // (startFrom, nameLc) -> local hit
+    mutable QHash<QPair<const Dir*,QByteArray>,const File*> d_includeCache; // (includer dir, directive) -> file
+    mutable QVector<QByteArray> d_contentCache; // File::d_id -> content, filled by getContent and prefetch
+    mutable QSet<quint32> d_reading; // ids being read by a prefetch job
+    mutable QMutex d_contentLock; // protects d_contentCache, d_reading and File::d_hash
+    mutable QWaitCondition d_contentRead;
+    QThreadPool* d_ioPool;
+    mutable quint32 d_includeHits;
+    mutable quint32 d_includeMisses;
+    mutable QMutex d_lookupLock; // protects the lookup caches and d_forceParse, recursive
 };
 }
 
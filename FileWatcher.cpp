@@ -0,0 +1,155 @@
+
+/*
+** Copyright (C) 2023 Rochus Keller (me@rochus-keller.ch)
+**
+** This file is part of the LisaPascal project.
+**
+** $QT_BEGIN_LICENSE:LGPL21$
+** GNU Lesser General Public License Usage
+** This file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 or version 3 as published by the Free
+** Software Foundation and appearing in the file LICENSE.LGPLv21 and
+** LICENSE.LGPLv3 included in the packaging of this file. Please review the
+** following information to ensure the GNU Lesser General Public License
+** requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*/
+
+
+#include "FileWatcher.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QSocketNotifier>
+#include <QTimer>
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+using namespace Lisa;
+
+FileWatcher::FileWatcher(QObject* parent):QObject(parent),d_fs(0),d_notifier(0),d_fd(-1),d_delay(300)
+{
+    d_timer = new QTimer(this);
+    d_timer->setSingleShot(true);
+    connect(d_timer,SIGNAL(timeout()),this,SLOT(onFlush()));
+}
+
+FileWatcher::~FileWatcher()
+{
+    stop();
+}
+
+void FileWatcher::watch(const FileSystem* fs)
+{
+    stop();
+    d_fs = fs;
+    if( fs == 0 || fs->getRootPath().isEmpty() || fs->isArchive() )
+        return;
+#ifdef Q_OS_LINUX
+    d_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if( d_fd < 0 )
+        return;
+    d_notifier = new QSocketNotifier(d_fd, QSocketNotifier::Read, this);
+    connect(d_notifier,SIGNAL(activated(int)),this,SLOT(onReadEvents()));
+    addDir(fs->getRootPath(), true);
+#endif
+}
+
+void FileWatcher::stop()
+{
+    d_timer->stop();
+    d_pending.clear();
+    d_dirs.clear();
+    if( d_notifier )
+        delete d_notifier;
+    d_notifier = 0;
+#ifdef Q_OS_LINUX
+    if( d_fd >= 0 )
+        ::close(d_fd); // also removes all watches
+#endif
+    d_fd = -1;
+    d_fs = 0;
+}
+
+void FileWatcher::addDir(const QString& path, bool recursive)
+{
+#ifdef Q_OS_LINUX
+    const int wd = ::inotify_add_watch(d_fd, path.toUtf8().constData(),
+                                       IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MODIFY |
+                                       IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR );
+    if( wd < 0 )
+        return;
+    d_dirs[wd] = path;
+    if( !recursive )
+        return;
+    QDir dir(path);
+    foreach( const QString& sub, dir.entryList( QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name ) )
+        addDir(dir.absoluteFilePath(sub), true);
+#else
+    Q_UNUSED(path);
+    Q_UNUSED(recursive);
+#endif
+}
+
+void FileWatcher::onReadEvents()
+{
+#ifdef Q_OS_LINUX
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    while( true )
+    {
+        const ssize_t len = ::read(d_fd, buf, sizeof(buf));
+        if( len <= 0 )
+            break; // EAGAIN, nothing left
+        for( const char* p = buf; p < buf + len; )
+        {
+            const struct inotify_event* e = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + e->len;
+            const QString dir = d_dirs.value(e->wd);
+            if( dir.isEmpty() || e->len == 0 )
+                continue;
+            const QString path = dir + "/" + QString::fromUtf8(e->name);
+            if( e->mask & IN_ISDIR )
+            {
+                if( e->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                {
+                    addDir(path, true);
+                    // files might already be there before the watch was set
+                    QDir sub(path);
+                    foreach( const QFileInfo& f, sub.entryInfoList( QStringList() << "*.txt", QDir::Files ) )
+                        d_pending.insert(f.absoluteFilePath());
+                }
+                continue;
+            }
+            if( path.endsWith(".txt", Qt::CaseInsensitive) )
+                d_pending.insert(path);
+        }
+    }
+    if( !d_pending.isEmpty() )
+        d_timer->start(d_delay); // restart, so a burst is reported only once
+#endif
+}
+
+void FileWatcher::onFlush()
+{
+    if( d_fs == 0 || d_pending.isEmpty() )
+        return;
+    QStringList added;
+    QList<const FileSystem::File*> modified, removed;
+    QStringList paths = d_pending.toList();
+    d_pending.clear();
+    paths.sort();
+    foreach( const QString& path, paths )
+    {
+        const FileSystem::File* f = d_fs->findFile(path);
+        const bool exists = QFileInfo(path).exists();
+        if( f && exists )
+            modified << f;
+        else if( f )
+            removed << f;
+        else if( exists && FileSystem::isSourceFile(path) )
+            added << path; // other files don't change the model, but would cause a full load
+    }
+    if( !added.isEmpty() || !modified.isEmpty() || !removed.isEmpty() )
+        emit filesChanged(added, modified, removed);
+}
@@ -0,0 +1,63 @@
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+
+/*
+** Copyright (C) 2023 Rochus Keller (me@rochus-keller.ch)
+**
+** This file is part of the LisaPascal project.
+**
+** $QT_BEGIN_LICENSE:LGPL21$
+** GNU Lesser General Public License Usage
+** This file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 or version 3 as published by the Free
+** Software Foundation and appearing in the file LICENSE.LGPLv21 and
+** LICENSE.LGPLv3 included in the packaging of this file. Please review the
+** following information to ensure the GNU Lesser General Public License
+** requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*/
+
+
+#include <LisaPascal/FileSystem.h>
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+
+class QSocketNotifier;
+class QTimer;
+
+namespace Lisa
+{
+// Watches the real directories of a loaded FileSystem with inotify and reports changed source files
+// after a burst of events has settled. Does nothing on other platforms than Linux.
+class FileWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FileWatcher(QObject* parent = 0);
+    ~FileWatcher();
+    void watch( const FileSystem* ); // call again after each FileSystem::load
+    void stop();
+    void setDelay(int ms) { d_delay = ms; }
+signals:
+    // added are real paths not yet known to the FileSystem
+    void filesChanged( const QStringList& added, const QList<const Lisa::FileSystem::File*>& modified,
+                       const QList<const Lisa::FileSystem::File*>& removed );
+protected slots:
+    void onReadEvents();
+    void onFlush();
+protected:
+    void addDir( const QString& path, bool recursive );
+private:
+    const FileSystem* d_fs;
+    QSocketNotifier* d_notifier;
+    QTimer* d_timer;
+    QHash<int,QString> d_dirs; // watch descriptor -> real dir path
+    QSet<QString> d_pending; // real paths touched since the last flush
+    int d_fd;
+    int d_delay;
+};
+}
+
+#endif // FILEWATCHER_H
@@ -0,0 +1,521 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the Lisa Pascal Navigator application.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "LisaCodeIndex.h"
+#include <QFile>
+#include <QtEndian>
+using namespace Lisa;
+
+static const char s_magic[] = "LPIX";
+static const int s_headerLen = 36;
+static const int s_fileLen = 72;
+static const int s_scopeLen = 12;
+static const int s_declLen = 16;
+static const int s_includeLen = 24;
+
+static inline quint32 packLoc(const RowCol& loc)
+{
+    return ( quint32(loc.d_row) << RowCol::COL_BIT_LEN ) | loc.d_col;
+}
+
+static inline RowCol unpackLoc(quint32 rc)
+{
+    return RowCol(rc >> RowCol::COL_BIT_LEN, rc & ( ( 1 << RowCol::COL_BIT_LEN ) - 1 ));
+}
+
+static void writeVarint(QByteArray& out, quint32 v)
+{
+    while( v >= 0x80 )
+    {
+        out.append(char( ( v & 0x7f ) | 0x80 ));
+        v >>= 7;
+    }
+    out.append(char(v));
+}
+
+static quint32 readVarint(const uchar*& p, const uchar* end)
+{
+    quint32 v = 0;
+    int shift = 0;
+    while( p < end && shift < 32 )
+    {
+        const uchar b = *p++;
+        v |= quint32( b & 0x7f ) << shift;
+        if( ( b & 0x80 ) == 0 )
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+static inline quint32 zigzag(qint32 v)
+{
+    return ( quint32(v) << 1 ) ^ quint32( v >> 31 );
+}
+
+static inline qint32 unzigzag(quint32 z)
+{
+    return qint32( ( z >> 1 ) ^ -qint32( z & 1 ) );
+}
+
+quint32 CodeIndexWriter::intern(const QByteArray& str)
+{
+    QHash<QByteArray, quint32>::const_iterator i = d_strIds.find(str);
+    if( i != d_strIds.end() )
+        return i.value();
+    const quint32 id = d_strs.size();
+    d_strIds.insert(str,id);
+    d_strs.append(str);
+    return id;
+}
+
+void CodeIndexWriter::addSymbols(CodeIndex::FileRec& f, const QVector<CodeIndex::SymRec>& syms)
+{
+    f.d_symOff = d_syms.size();
+    f.d_symCount = syms.size();
+    RowCol prev;
+    quint32 prevDecl = 0;
+    foreach( const CodeIndex::SymRec& s, syms )
+    {
+        Q_ASSERT( s.d_loc.d_row >= prev.d_row );
+        writeVarint(d_syms, s.d_loc.d_row - prev.d_row);
+        writeVarint(d_syms, s.d_loc.d_row == prev.d_row ? s.d_loc.d_col - prev.d_col : s.d_loc.d_col);
+        const qint32 delta = qint32( s.d_decl - prevDecl );
+        writeVarint(d_syms, zigzag(delta));
+        prev = s.d_loc;
+        prevDecl = s.d_decl;
+    }
+}
+
+void CodeIndexWriter::addComments(CodeIndex::FileRec& f, const QHash<quint32, PpLexer::Comments>& comments)
+{
+    f.d_commentOff = d_syms.size();
+    writeVarint(d_syms, comments.size());
+    QHash<quint32, PpLexer::Comments>::const_iterator i;
+    for( i = comments.begin(); i != comments.end(); ++i )
+    {
+        writeVarint(d_syms, i.key());
+        writeVarint(d_syms, i.value().size());
+        PpLexer::Comment prev = PpLexer::Comment();
+        foreach( const PpLexer::Comment& c, i.value() )
+        {
+            Q_ASSERT( c.d_pos >= prev.d_pos && c.d_loc.d_row >= prev.d_loc.d_row && c.d_endRow >= c.d_loc.d_row );
+            writeVarint(d_syms, c.d_pos - prev.d_pos);
+            writeVarint(d_syms, c.d_len);
+            writeVarint(d_syms, c.d_loc.d_row - prev.d_loc.d_row);
+            writeVarint(d_syms, c.d_loc.d_col);
+            writeVarint(d_syms, c.d_endRow - c.d_loc.d_row);
+            prev = c;
+        }
+    }
+}
+
+void CodeIndexWriter::addDeferred(CodeIndex::FileRec& f, const QList<CodeIndex::DeferredRec>& deferred)
+{
+    f.d_deferredOff = d_syms.size();
+    writeVarint(d_syms, deferred.size());
+    foreach( const CodeIndex::DeferredRec& d, deferred )
+    {
+        writeVarint(d_syms, d.d_scope);
+        writeVarint(d_syms, d.d_state.d_levels.size());
+        foreach( const PpLexer::State::Level& l, d.d_state.d_levels )
+        {
+            writeVarint(d_syms, intern(l.d_path.toUtf8()));
+            writeVarint(d_syms, l.d_line);
+            writeVarint(d_syms, l.d_col);
+        }
+        writeVarint(d_syms, d.d_state.d_ppVars.size());
+        PpLexer::PpVars::const_iterator i;
+        for( i = d.d_state.d_ppVars.begin(); i != d.d_state.d_ppVars.end(); ++i )
+        {
+            writeVarint(d_syms, intern(i.key()));
+            writeVarint(d_syms, zigzag(i.value()));
+        }
+        writeVarint(d_syms, d.d_state.d_conditionStack.size());
+        foreach( const PpLexer::ppstatus& c, d.d_state.d_conditionStack )
+            writeVarint(d_syms, ( c.open ? 1 : 0 ) | ( c.openSeen ? 2 : 0 ) | ( c.elseSeen ? 4 : 0 ));
+    }
+}
+
+bool CodeIndexWriter::write(const QString& path)
+{
+    // write to a temporary file first, so a reader never sees a partial index
+    const QString tmp = path + ".tmp";
+    QFile out(tmp);
+    if( !out.open(QIODevice::WriteOnly) )
+        return error(QString("cannot open file %1 for writing").arg(tmp));
+
+    const quint32 symOff = s_headerLen + d_files.size() * s_fileLen + d_scopes.size() * s_scopeLen +
+            d_decls.size() * s_declLen + d_includes.size() * s_includeLen + d_imports.size() * 4;
+    QByteArray buf(symOff, 0);
+    uchar* p = (uchar*)buf.data();
+    ::memcpy(p, s_magic, 4);
+    qToLittleEndian<quint32>(CodeIndex::Version, p + 4);
+    qToLittleEndian<quint32>(d_files.size(), p + 8);
+    qToLittleEndian<quint32>(d_scopes.size(), p + 12);
+    qToLittleEndian<quint32>(d_decls.size(), p + 16);
+    qToLittleEndian<quint32>(d_includes.size(), p + 20);
+    qToLittleEndian<quint32>(d_imports.size(), p + 24);
+    qToLittleEndian<quint32>(symOff, p + 28);
+    qToLittleEndian<quint32>(symOff + d_syms.size(), p + 32);
+    p += s_headerLen;
+    foreach( const CodeIndex::FileRec& f, d_files )
+    {
+        qToLittleEndian<quint32>(f.d_path, p);
+        qToLittleEndian<quint32>(f.d_same, p + 4);
+        qToLittleEndian<quint64>(f.d_hash, p + 8);
+        qToLittleEndian<quint64>(f.d_fingerprint, p + 16);
+        qToLittleEndian<quint32>(f.d_sloc, p + 24);
+        qToLittleEndian<quint32>(f.d_intf, p + 28);
+        qToLittleEndian<quint32>(f.d_impl, p + 32);
+        qToLittleEndian<quint32>(f.d_firstInclude, p + 36);
+        qToLittleEndian<quint32>(f.d_includeCount, p + 40);
+        qToLittleEndian<quint32>(f.d_firstImport, p + 44);
+        qToLittleEndian<quint32>(f.d_importCount, p + 48);
+        qToLittleEndian<quint32>(f.d_symOff, p + 52);
+        qToLittleEndian<quint32>(f.d_symCount, p + 56);
+        qToLittleEndian<quint32>(f.d_commentOff, p + 60);
+        qToLittleEndian<quint32>(f.d_deferredOff, p + 64);
+        p += s_fileLen;
+    }
+    foreach( const CodeIndex::ScopeRec& s, d_scopes )
+    {
+        qToLittleEndian<quint32>(s.d_type, p);
+        qToLittleEndian<quint32>(s.d_firstDecl, p + 4);
+        qToLittleEndian<quint32>(s.d_declCount, p + 8);
+        p += s_scopeLen;
+    }
+    foreach( const CodeIndex::DeclRec& d, d_decls )
+    {
+        qToLittleEndian<quint32>(d.d_name, p);
+        qToLittleEndian<quint32>(packLoc(d.d_loc), p + 4);
+        p[8] = d.d_type;
+        p[9] = d.d_external;
+        qToLittleEndian<quint32>(d.d_body, p + 12);
+        p += s_declLen;
+    }
+    foreach( const CodeIndex::IncludeRec& i, d_includes )
+    {
+        qToLittleEndian<quint32>(i.d_path, p);
+        qToLittleEndian<quint32>(i.d_directive, p + 4);
+        qToLittleEndian<quint32>(packLoc(i.d_loc), p + 8);
+        qToLittleEndian<quint32>(i.d_len, p + 12);
+        qToLittleEndian<quint64>(i.d_hash, p + 16);
+        p += s_includeLen;
+    }
+    foreach( quint32 i, d_imports )
+    {
+        qToLittleEndian<quint32>(i, p);
+        p += 4;
+    }
+    if( out.write(buf) != buf.size() || out.write(d_syms) != d_syms.size() )
+        return error("cannot write records");
+
+    QByteArray offs(( d_strs.size() + 2 ) * 4, 0);
+    p = (uchar*)offs.data();
+    qToLittleEndian<quint32>(d_strs.size(), p);
+    quint32 off = 0;
+    for( int i = 0; i < d_strs.size(); i++ )
+    {
+        qToLittleEndian<quint32>(off, p + 4 + i * 4);
+        off += d_strs[i].size();
+    }
+    qToLittleEndian<quint32>(off, p + 4 + d_strs.size() * 4);
+    if( out.write(offs) != offs.size() )
+        return error("cannot write string table");
+    foreach( const QByteArray& str, d_strs )
+        out.write(str);
+    out.close();
+    if( out.error() != QFile::NoError )
+        return error(QString("cannot write file %1").arg(tmp));
+    QFile::remove(path);
+    if( !QFile::rename(tmp, path) )
+        return error(QString("cannot rename %1 to %2").arg(tmp).arg(path));
+    return true;
+}
+
+bool CodeIndexWriter::error(const QString& msg)
+{
+    d_error = msg;
+    return false;
+}
+
+CodeIndexReader::CodeIndexReader():d_file(0),d_data(0),d_size(0),d_fileCount(0),d_scopeCount(0),d_declCount(0),
+    d_includeCount(0),d_importCount(0),d_strCount(0),d_fileRecs(0),d_scopeRecs(0),d_declRecs(0),d_includeRecs(0),
+    d_importRecs(0),d_strOffs(0),d_strData(0),d_strLen(0),d_syms(0),d_symLen(0)
+{
+}
+
+CodeIndexReader::~CodeIndexReader()
+{
+    close();
+}
+
+bool CodeIndexReader::open(const QString& path)
+{
+    close();
+    d_file = new QFile(path);
+    if( !d_file->open(QIODevice::ReadOnly) )
+        return error(QString("cannot open file %1").arg(path));
+    d_size = d_file->size();
+    if( d_size < s_headerLen )
+        return error("file too short");
+    d_data = d_file->map(0,d_size);
+    if( d_data == 0 )
+        return error(QString("cannot map file %1").arg(path));
+    if( ::memcmp(d_data, s_magic, 4) != 0 )
+        return error("not a code index file");
+    if( qFromLittleEndian<quint32>(d_data + 4) != CodeIndex::Version )
+        return error("incompatible code index version");
+    quint64 off = s_headerLen;
+    const quint32 counts[] = { qFromLittleEndian<quint32>(d_data + 8), qFromLittleEndian<quint32>(d_data + 12),
+                               qFromLittleEndian<quint32>(d_data + 16), qFromLittleEndian<quint32>(d_data + 20),
+                               qFromLittleEndian<quint32>(d_data + 24) };
+    const int lens[] = { s_fileLen, s_scopeLen, s_declLen, s_includeLen, 4 };
+    const uchar** tables[] = { &d_fileRecs, &d_scopeRecs, &d_declRecs, &d_includeRecs, &d_importRecs };
+    for( int i = 0; i < 5; i++ )
+    {
+        *tables[i] = d_data + off;
+        off += quint64(counts[i]) * lens[i];
+    }
+    const quint32 symOff = qFromLittleEndian<quint32>(d_data + 28);
+    const quint32 strOff = qFromLittleEndian<quint32>(d_data + 32);
+    if( off != symOff || symOff > strOff || quint64(strOff) + 4 > d_size )
+        return error("invalid table size");
+    d_fileCount = counts[0];
+    d_scopeCount = counts[1];
+    d_declCount = counts[2];
+    d_includeCount = counts[3];
+    d_importCount = counts[4];
+    d_syms = d_data + symOff;
+    d_symLen = strOff - symOff;
+    d_strCount = qFromLittleEndian<quint32>(d_data + strOff);
+    d_strOffs = d_data + strOff + 4;
+    d_strData = d_strOffs + ( quint64(d_strCount) + 1 ) * 4;
+    if( d_strData > d_data + d_size )
+        return error("invalid string table size");
+    d_strLen = qFromLittleEndian<quint32>(d_strOffs + d_strCount * 4);
+    if( quint64(d_strLen) > quint64( d_data + d_size - d_strData ) )
+        return error("invalid string table size");
+    return true;
+}
+
+void CodeIndexReader::close()
+{
+    if( d_file )
+        delete d_file; // also unmaps
+    d_file = 0;
+    d_data = 0;
+    d_size = 0;
+    d_fileCount = d_scopeCount = d_declCount = d_includeCount = d_importCount = d_strCount = 0;
+    d_symLen = 0;
+    d_strLen = 0;
+}
+
+CodeIndex::FileRec CodeIndexReader::getFile(quint32 i) const
+{
+    Q_ASSERT( i < d_fileCount );
+    const uchar* p = d_fileRecs + i * s_fileLen;
+    CodeIndex::FileRec f;
+    f.d_path = qFromLittleEndian<quint32>(p);
+    f.d_same = qFromLittleEndian<quint32>(p + 4);
+    f.d_hash = qFromLittleEndian<quint64>(p + 8);
+    f.d_fingerprint = qFromLittleEndian<quint64>(p + 16);
+    f.d_sloc = qFromLittleEndian<quint32>(p + 24);
+    f.d_intf = qFromLittleEndian<quint32>(p + 28);
+    f.d_impl = qFromLittleEndian<quint32>(p + 32);
+    f.d_firstInclude = qFromLittleEndian<quint32>(p + 36);
+    f.d_includeCount = qFromLittleEndian<quint32>(p + 40);
+    f.d_firstImport = qFromLittleEndian<quint32>(p + 44);
+    f.d_importCount = qFromLittleEndian<quint32>(p + 48);
+    f.d_symOff = qFromLittleEndian<quint32>(p + 52);
+    f.d_symCount = qFromLittleEndian<quint32>(p + 56);
+    f.d_commentOff = qFromLittleEndian<quint32>(p + 60);
+    f.d_deferredOff = qFromLittleEndian<quint32>(p + 64);
+    // clamp the ranges, so a damaged index can't make the caller read beyond the tables
+    if( quint64(f.d_firstInclude) + f.d_includeCount > d_includeCount )
+        f.d_includeCount = 0;
+    if( quint64(f.d_firstImport) + f.d_importCount > d_importCount )
+        f.d_importCount = 0;
+    if( f.d_intf >= d_scopeCount )
+        f.d_intf = CodeIndex::None;
+    if( f.d_impl >= d_scopeCount )
+        f.d_impl = CodeIndex::None;
+    return f;
+}
+
+CodeIndex::ScopeRec CodeIndexReader::getScope(quint32 i) const
+{
+    Q_ASSERT( i < d_scopeCount );
+    const uchar* p = d_scopeRecs + i * s_scopeLen;
+    CodeIndex::ScopeRec s;
+    s.d_type = qFromLittleEndian<quint32>(p);
+    s.d_firstDecl = qFromLittleEndian<quint32>(p + 4);
+    s.d_declCount = qFromLittleEndian<quint32>(p + 8);
+    if( quint64(s.d_firstDecl) + s.d_declCount > d_declCount )
+        s.d_declCount = 0;
+    return s;
+}
+
+CodeIndex::DeclRec CodeIndexReader::getDecl(quint32 i) const
+{
+    Q_ASSERT( i < d_declCount );
+    const uchar* p = d_declRecs + i * s_declLen;
+    CodeIndex::DeclRec d;
+    d.d_name = qFromLittleEndian<quint32>(p);
+    d.d_loc = unpackLoc(qFromLittleEndian<quint32>(p + 4));
+    d.d_type = p[8];
+    d.d_external = p[9];
+    d.d_body = qFromLittleEndian<quint32>(p + 12);
+    if( d.d_body >= d_scopeCount )
+        d.d_body = CodeIndex::None;
+    return d;
+}
+
+CodeIndex::IncludeRec CodeIndexReader::getInclude(quint32 i) const
+{
+    Q_ASSERT( i < d_includeCount );
+    const uchar* p = d_includeRecs + i * s_includeLen;
+    CodeIndex::IncludeRec inc;
+    inc.d_path = qFromLittleEndian<quint32>(p);
+    inc.d_directive = qFromLittleEndian<quint32>(p + 4);
+    inc.d_loc = unpackLoc(qFromLittleEndian<quint32>(p + 8));
+    inc.d_len = qFromLittleEndian<quint32>(p + 12);
+    inc.d_hash = qFromLittleEndian<quint64>(p + 16);
+    return inc;
+}
+
+quint32 CodeIndexReader::getImport(quint32 i) const
+{
+    Q_ASSERT( i < d_importCount );
+    return qFromLittleEndian<quint32>(d_importRecs + i * 4);
+}
+
+QByteArray CodeIndexReader::getString(quint32 i) const
+{
+    if( i >= d_strCount )
+        return QByteArray();
+    const quint32 from = qFromLittleEndian<quint32>(d_strOffs + i * 4);
+    const quint32 to = qFromLittleEndian<quint32>(d_strOffs + i * 4 + 4);
+    if( from > to || to > d_strLen )
+        return QByteArray();
+    return QByteArray::fromRawData((const char*)d_strData + from, to - from);
+}
+
+QVector<CodeIndex::SymRec> CodeIndexReader::getSymbols(const CodeIndex::FileRec& f) const
+{
+    QVector<CodeIndex::SymRec> res;
+    if( f.d_symOff >= d_symLen )
+        return res;
+    res.reserve(f.d_symCount);
+    const uchar* p = d_syms + f.d_symOff;
+    const uchar* end = d_syms + d_symLen;
+    RowCol prev;
+    quint32 prevDecl = 0;
+    for( quint32 i = 0; i < f.d_symCount && p < end; i++ )
+    {
+        CodeIndex::SymRec s;
+        const quint32 rowDelta = readVarint(p, end);
+        const quint32 col = readVarint(p, end);
+        s.d_loc.d_row = prev.d_row + rowDelta;
+        s.d_loc.d_col = rowDelta == 0 ? prev.d_col + col : col;
+        const quint32 z = readVarint(p, end);
+        s.d_decl = prevDecl + quint32( unzigzag(z) );
+        res.append(s);
+        prev = s.d_loc;
+        prevDecl = s.d_decl;
+    }
+    return res;
+}
+
+QHash<quint32, PpLexer::Comments> CodeIndexReader::getComments(const CodeIndex::FileRec& f) const
+{
+    QHash<quint32, PpLexer::Comments> res;
+    if( f.d_commentOff >= d_symLen )
+        return res;
+    const uchar* p = d_syms + f.d_commentOff;
+    const uchar* end = d_syms + d_symLen;
+    const quint32 paths = readVarint(p, end);
+    for( quint32 i = 0; i < paths && p < end; i++ )
+    {
+        const quint32 path = readVarint(p, end);
+        const quint32 count = readVarint(p, end);
+        PpLexer::Comments& list = res[path];
+        PpLexer::Comment prev = PpLexer::Comment();
+        for( quint32 j = 0; j < count && p < end; j++ )
+        {
+            PpLexer::Comment c;
+            c.d_pos = prev.d_pos + readVarint(p, end);
+            c.d_len = readVarint(p, end);
+            c.d_loc.d_row = prev.d_loc.d_row + readVarint(p, end);
+            c.d_loc.d_col = readVarint(p, end);
+            c.d_endRow = c.d_loc.d_row + readVarint(p, end);
+            list.append(c);
+            prev = c;
+        }
+    }
+    return res;
+}
+
+QList<CodeIndex::DeferredRec> CodeIndexReader::getDeferred(const CodeIndex::FileRec& f) const
+{
+    QList<CodeIndex::DeferredRec> res;
+    if( f.d_deferredOff >= d_symLen )
+        return res;
+    const uchar* p = d_syms + f.d_deferredOff;
+    const uchar* end = d_syms + d_symLen;
+    const quint32 count = readVarint(p, end);
+    for( quint32 i = 0; i < count && p < end; i++ )
+    {
+        CodeIndex::DeferredRec d(readVarint(p, end));
+        const quint32 levels = readVarint(p, end);
+        for( quint32 j = 0; j < levels && p < end; j++ )
+        {
+            PpLexer::State::Level l;
+            l.d_path = QString::fromUtf8(getString(readVarint(p, end)));
+            l.d_line = readVarint(p, end);
+            l.d_col = readVarint(p, end);
+            d.d_state.d_levels.append(l);
+        }
+        const quint32 vars = readVarint(p, end);
+        for( quint32 j = 0; j < vars && p < end; j++ )
+        {
+            const QByteArray name = getString(readVarint(p, end));
+            const qint32 value = unzigzag(readVarint(p, end));
+            d.d_state.d_ppVars.insert(QByteArray(name.constData(), name.size()), value); // detach from the mapping
+        }
+        const quint32 conds = readVarint(p, end);
+        for( quint32 j = 0; j < conds && p < end; j++ )
+        {
+            const quint32 bits = readVarint(p, end);
+            PpLexer::ppstatus c(bits & 1);
+            c.openSeen = bits & 2;
+            c.elseSeen = bits & 4;
+            d.d_state.d_conditionStack.append(c);
+        }
+        res.append(d);
+    }
+    return res;
+}
+
+bool CodeIndexReader::error(const QString& msg)
+{
+    d_error = msg;
+    return false;
+}
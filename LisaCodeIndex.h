@@ -0,0 +1,171 @@
+#ifndef LISACODEINDEX_H
+#define LISACODEINDEX_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file is part of the Lisa Pascal Navigator application.
+*
+* The following is the license that applies to this copy of the
+* application. For a license to use the library under conditions
+* other than those described here, please email to me@rochus-keller.ch.
+*
+* GNU General Public License Usage
+* This file may be used under the terms of the GNU General Public
+* License (GPL) versions 2.0 or 3.0 as published by the Free Software
+* Foundation and appearing in the file LICENSE.GPL included in
+* the packaging of this file. Please review the following information
+* to ensure GNU General Public Licensing requirements will be met:
+* http://www.fsf.org/licensing/licenses/info/GPLv2.html and
+* http://www.gnu.org/copyleft/gpl.html.
+*/
+
+#include "LisaRowCol.h"
+#include "PpLexer.h"
+#include <QHash>
+#include <QVector>
+
+class QFile;
+
+namespace Lisa
+{
+// Binary code model index, all numbers little endian:
+//   header:   "LPIX", u32 version, u32 count of files, scopes, decls, includes and imports,
+//             u32 offset of the symbol data, u32 offset of the string table
+//   files:    72 bytes each: u32 path, u32 identical file or None, u64 content hash, u64 interface fingerprint,
+//             u32 sloc, u32 interface scope, u32 implementation scope, u32 first include, u32 include count,
+//             u32 first import, u32 import count, u32 symbol data offset, u32 symbol count,
+//             u32 comment data offset or None if the comments were not recorded, u32 deferred data offset,
+//             u32 unused
+//   scopes:   12 bytes each: u32 type, u32 first decl, u32 decl count; the decls of a scope are contiguous
+//   decls:    16 bytes each: u32 name, u32 row << 13 | col, u8 type, u8 external, u16 unused, u32 body scope
+//   includes: 24 bytes each: u32 path, u32 directive or None, u32 row << 13 | col, u32 len, u64 content hash
+//   imports:  u32 file index each
+//   symbols:  per file and symbol in row/col order varints of the row delta, the col (delta on the same row)
+//             and the zigzag encoded delta of the decl index + 1
+//   comments: per file after the symbols varints of the number of source paths, and per path of the path string,
+//             the number of comments and per comment of the pos delta, len, row delta, col and row span
+//   deferred: per file after the comments varints of the number of statement parts not yet parsed, and per part
+//             of the body scope, the include level count, per level the path string, line and col, the number of
+//             preprocessor variables, per variable the name string and the zigzag encoded value, the number of
+//             conditions and per condition the open, openSeen and elseSeen bits
+//   strings:  u32 count, u32 offsets[count + 1] relative to the end of the offset array, utf8 bytes
+struct CodeIndex
+{
+    enum { Version = 3, None = 0xffffffff };
+    struct FileRec
+    {
+        quint32 d_path, d_same;
+        quint64 d_hash, d_fingerprint;
+        quint32 d_sloc, d_intf, d_impl;
+        quint32 d_firstInclude, d_includeCount, d_firstImport, d_importCount, d_symOff, d_symCount, d_commentOff;
+        quint32 d_deferredOff;
+        FileRec():d_path(None),d_same(None),d_hash(0),d_fingerprint(0),d_sloc(0),d_intf(None),d_impl(None),
+            d_firstInclude(0),d_includeCount(0),d_firstImport(0),d_importCount(0),d_symOff(0),d_symCount(0),
+            d_commentOff(None),d_deferredOff(None){}
+    };
+    struct ScopeRec
+    {
+        quint32 d_type, d_firstDecl, d_declCount;
+        ScopeRec():d_type(0),d_firstDecl(0),d_declCount(0){}
+    };
+    struct DeclRec
+    {
+        quint32 d_name;
+        RowCol d_loc;
+        quint8 d_type;
+        bool d_external;
+        quint32 d_body;
+        DeclRec():d_name(None),d_type(0),d_external(false),d_body(None){}
+    };
+    struct IncludeRec
+    {
+        quint32 d_path, d_directive;
+        RowCol d_loc;
+        quint32 d_len;
+        quint64 d_hash;
+        IncludeRec():d_path(None),d_directive(None),d_len(0),d_hash(0){}
+    };
+    struct SymRec
+    {
+        RowCol d_loc;
+        quint32 d_decl; // decl record + 1, 0 if none
+        SymRec(const RowCol& loc = RowCol(), quint32 decl = 0):d_loc(loc),d_decl(decl){}
+    };
+    struct DeferredRec
+    {
+        quint32 d_scope; // the body whose statement part is not parsed yet
+        PpLexer::State d_state;
+        DeferredRec(quint32 scope = None, const PpLexer::State& state = PpLexer::State()):d_scope(scope),d_state(state){}
+    };
+};
+
+class CodeIndexWriter
+{
+public:
+    // fill the tables, then call write
+    QVector<CodeIndex::FileRec> d_files;
+    QVector<CodeIndex::ScopeRec> d_scopes;
+    QVector<CodeIndex::DeclRec> d_decls;
+    QVector<CodeIndex::IncludeRec> d_includes;
+    QVector<quint32> d_imports; // file records
+
+    quint32 intern( const QByteArray& );
+    void addSymbols( CodeIndex::FileRec&, const QVector<CodeIndex::SymRec>& ); // in row/col order
+    void addComments( CodeIndex::FileRec&, const QHash<quint32,PpLexer::Comments>& ); // path string -> comments
+    void addDeferred( CodeIndex::FileRec&, const QList<CodeIndex::DeferredRec>& );
+    bool write( const QString& path );
+    const QString& getError() const { return d_error; }
+protected:
+    bool error( const QString& );
+private:
+    QHash<QByteArray,quint32> d_strIds;
+    QList<QByteArray> d_strs;
+    QByteArray d_syms;
+    QString d_error;
+};
+
+class CodeIndexReader
+{
+public:
+    CodeIndexReader();
+    ~CodeIndexReader();
+    bool open( const QString& path );
+    void close();
+    const QString& getError() const { return d_error; }
+
+    // random access to the mapped records
+    quint32 getFileCount() const { return d_fileCount; }
+    CodeIndex::FileRec getFile( quint32 ) const;
+    CodeIndex::ScopeRec getScope( quint32 ) const;
+    quint32 getScopeCount() const { return d_scopeCount; }
+    CodeIndex::DeclRec getDecl( quint32 ) const;
+    quint32 getDeclCount() const { return d_declCount; }
+    CodeIndex::IncludeRec getInclude( quint32 ) const;
+    quint32 getImport( quint32 ) const;
+    QByteArray getString( quint32 ) const; // refers to the mapped file, valid until close()
+    QVector<CodeIndex::SymRec> getSymbols( const CodeIndex::FileRec& ) const;
+    QHash<quint32,PpLexer::Comments> getComments( const CodeIndex::FileRec& ) const; // path string -> comments
+    QList<CodeIndex::DeferredRec> getDeferred( const CodeIndex::FileRec& ) const;
+protected:
+    bool error( const QString& );
+private:
+    QFile* d_file;
+    const uchar* d_data;
+    quint32 d_size;
+    quint32 d_fileCount, d_scopeCount, d_declCount, d_includeCount, d_importCount, d_strCount;
+    const uchar* d_fileRecs;
+    const uchar* d_scopeRecs;
+    const uchar* d_declRecs;
+    const uchar* d_includeRecs;
+    const uchar* d_importRecs;
+    const uchar* d_strOffs;
+    const uchar* d_strData;
+    quint32 d_strLen;
+    const uchar* d_syms;
+    quint32 d_symLen;
+    QString d_error;
+};
+}
+
+#endif // LISACODEINDEX_H
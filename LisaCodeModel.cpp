@@ -20,18 +20,32 @@
 #include "LisaCodeModel.h"
 #include "PpLexer.h"
 #include "LisaParser.h"
+#include "LisaCodeIndex.h"
+#include "LisaToken.h"
+#include <QDir>
 #include <QFile>
 #include <QPixmap>
 #include <QtDebug>
-#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QThreadPool>
+#include <QRunnable>
+#include <algorithm>
 using namespace Lisa;
 
+namespace Lisa
+{
 class CodeModelVisitor
 {
     CodeModel* d_mdl;
     CodeFile* d_cf;
 public:
-    CodeModelVisitor(CodeModel* m):d_mdl(m) {}
+    CodeModelVisitor(CodeModel* m):d_mdl(m),d_resolveNs(0) {}
+    QHash<SynTree*,PpLexer::State> d_deferred;
+    qint64 d_resolveNs; // time spent in findDecl, only measured if CodeModel::d_profile
+    // the symbols get unit-local numbers, CodeModel::assignIndexes replaces them by d_decls indexes
+    QHash<Declaration*,quint32> d_local;
+    QVector<Declaration*> d_symDecls; // local number - 1 -> declaration
 
     void visit( CodeFile* cf, SynTree* top )
     {      
@@ -51,6 +65,11 @@ public:
             break;
         }
     }
+    void deferredBody( CodeFile* cf, Scope* scope, SynTree* st )
+    {
+        d_cf = cf;
+        statement_part(scope,st);
+    }
     void program( CodeFile* cf, SynTree* st )
     {
         Scope* s = new Scope();
@@ -69,6 +88,7 @@ public:
                 break;
             }
         }
+        s->freeze();
     }
     void regular_unit( CodeFile* cf, SynTree* st )
     {
@@ -97,6 +117,8 @@ public:
             if( s->d_tok.d_type == SynTree::R_procedure_and_function_declaration_part)
                 procedure_and_function_interface_part(newScope,s);
         }
+        newScope->freeze();
+        cf->buildExports();
     }
     void procedure_and_function_interface_part(Scope* scope, SynTree* st)
     {
@@ -125,6 +147,7 @@ public:
             if( s->d_tok.d_type == SynTree::R_subroutine_part)
                 subroutine_part(newScope,s);
         }
+        newScope->freeze();
     }
     void subroutine_part(Scope* scope, SynTree* st)
     {
@@ -203,9 +226,10 @@ public:
         Declaration* d = new Declaration();
         d->d_type = type;
         d->d_name = t.d_val;
+        d->d_id = t.d_id;
         d->d_loc = t.toLoc();
         d->d_owner = scope;
-        scope->d_order.append(d);
+        scope->add(d);
         return d;
     }
 
@@ -372,6 +396,7 @@ public:
         foreach( SynTree* s, st->d_children )
             if( s->d_tok.d_type == SynTree::R_formal_parameter_list)
                 formal_parameter_list(d->d_body, s);
+        d->d_body->freeze();
     }
     void formal_parameter_list(Scope* scope, SynTree* st)
     {
@@ -405,23 +430,32 @@ public:
                 type_identifier(scope,s);
         }
     }
-    Symbol* addSym(Scope* scope, const Token& t)
+    Declaration* addSym(Scope* scope, const Token& t)
     {
-        Declaration* d = scope->findDecl(t.d_val);
+        Declaration* d;
+        if( d_mdl->d_profile )
+        {
+            QElapsedTimer timer;
+            timer.start();
+            d = scope->findDecl(t.d_id);
+            d_resolveNs += timer.nsecsElapsed();
+        }else
+            d = scope->findDecl(t.d_id);
         if( d )
         {
-            Symbol* sy = new Symbol();
-            sy->d_decl = d;
-            sy->d_loc = t.toLoc();
-            d_cf->d_syms.append(sy);
-            if( sy->d_decl && sy->d_decl->isDeclaration() )
+            Symbol sy;
+            sy.d_loc = t.toLoc();
+            sy.d_len = d->getLen();
+            quint32& n = d_local[d];
+            if( n == 0 )
             {
-                Declaration* d = static_cast<Declaration*>(sy->d_decl);
-                d->d_refs[d_cf].append(sy);
+                d_symDecls.append(d);
+                n = d_symDecls.size();
             }
-            return sy;
-        }else
-            return 0;
+            sy.d_decl = n;
+            d_cf->d_syms.append(sy);
+        }
+        return d;
     }
     void type_identifier(Scope* scope, SynTree* st)
     {
@@ -460,6 +494,7 @@ public:
         foreach( SynTree* s, st->d_children )
             if( s->d_tok.d_type == SynTree::R_formal_parameter_list)
                 formal_parameter_list(d->d_body, s);
+        d->d_body->freeze();
     }
     void body_(Scope* scope, SynTree* st)
     {
@@ -475,6 +510,14 @@ public:
     }
     void statement_part( Scope* scope, SynTree* st)
     {
+        if( st->d_children.isEmpty() && d_deferred.contains(st) )
+        {
+            CodeFile::Deferred d;
+            d.d_scope = scope;
+            d.d_state = d_deferred.value(st);
+            d_cf->d_deferred.append(d);
+            return;
+        }
         if( !st->d_children.isEmpty() && st->d_children.first()->d_tok.d_type == SynTree::R_compound_statement )
             compound_statement(scope, st->d_children.first());
     }
@@ -647,20 +690,23 @@ public:
     void expression( Scope* scope, SynTree* st)
     {
         foreach( SynTree* s, st->d_children )
-            if( s->d_tok.d_type == SynTree::R_simple_expression)
-                simple_expression(scope,s);
+            operand(scope,s);
     }
-    void simple_expression(Scope* scope, SynTree* st)
+    void operand(Scope* scope, SynTree* st)
     {
-        foreach( SynTree* s, st->d_children )
-            if( s->d_tok.d_type == SynTree::R_term)
-                term(scope,s);
-    }
-    void term(Scope* scope, SynTree* st)
-    {
-        foreach( SynTree* s, st->d_children )
-            if( s->d_tok.d_type == SynTree::R_factor)
-                factor(scope,s);
+        // binary R_simple_expression and R_term, unary R_sign, or a plain factor
+        switch( st->d_tok.d_type )
+        {
+        case SynTree::R_simple_expression:
+        case SynTree::R_term:
+        case SynTree::R_sign:
+            foreach( SynTree* s, st->d_children )
+                operand(scope,s);
+            break;
+        case SynTree::R_factor:
+            factor(scope,st);
+            break;
+        }
     }
     void factor(Scope* scope, SynTree* st)
     {
@@ -727,10 +773,42 @@ public:
 
 protected:
 };
+}
+
+static void errorLines( FileSystem* fs, const Parser& p, QStringList& lines )
+{
+    const int off = fs->getRootPath().size();
+    foreach( const Parser::Error& e, p.errors )
+    {
+        const FileSystem::File* f = fs->findFile(e.path);
+        lines << QObject::tr("%1:%2:%3: %4").arg( f ? f->getVirtualPath() : e.path.mid(off) ).arg(e.row)
+                .arg(e.col).arg(e.msg);
+    }
+}
+
+static void printErrors( FileSystem* fs, const Parser& p )
+{
+    QStringList lines;
+    errorLines(fs, p, lines);
+    foreach( const QString& line, lines )
+        qCritical() << line.toUtf8().constData();
+}
+
+struct CodeModel::Restored
+{
+    QVector<CodeFile*> d_files; // file record -> restored file, 0 if stale or gone
+    QHash<const CodeFile*,quint32> d_records; // file -> its record, for all files found in the index
+    QVector<Declaration*> d_decls; // decl record -> declaration
+    QVector<Scope*> d_scopes; // scope record -> scope
+    QList<QList<CodeFile*> > d_imports; // by file record, the files the uses clause resolved to
+};
 
-CodeModel::CodeModel(QObject *parent) : QAbstractItemModel(parent),d_sloc(0)
+CodeModel::CodeModel(QObject *parent) : QAbstractItemModel(parent),d_sloc(0),d_lazyBodies(true),d_collectComments(true),
+    d_refsDirty(true),d_sharedCount(0),d_sharedBytes(0),d_sharedTime(0),d_parallel(true),d_useIndex(true),
+    d_profile(false),d_resolveNs(0),d_lastProgress(0),d_filesDone(0),d_filesTotal(0),d_slocDone(0)
 {
     d_fs = new FileSystem(this);
+    d_decls.append(0);
 }
 
 bool CodeModel::load(const QString& rootDir)
@@ -740,20 +818,69 @@ bool CodeModel::load(const QString& rootDir)
     d_top.clear();
     d_map1.clear();
     d_map2.clear();
+    d_comments.clear();
+    d_byHash.clear();
+    d_includeHashes.clear();
+    d_decls.resize(1); // the declarations were deleted with d_top
+    d_freeDecls.clear();
+    d_releasedDecls.clear();
+    d_refsDirty = true;
+    d_sharedCount = 0;
+    d_sharedBytes = 0;
+    d_sharedTime = 0;
     d_sloc = 0;
+    d_resolveNs = 0;
+    d_cancel = 0;
+    d_loadTimer.start();
+    d_lastProgress = 0;
+    d_filesDone = 0;
+    d_slocDone = 0;
     d_fs->load(rootDir);
     QList<Slot*> fileSlots;
     fillFolders(&d_root,&d_fs->getRoot(), &d_top, fileSlots);
+    QList<CodeFile*> files;
     foreach( Slot* s, fileSlots )
     {
         Q_ASSERT( s->d_thing && s->d_thing->d_type == Thing::File);
         CodeFile* f = static_cast<CodeFile*>(s->d_thing);
         Q_ASSERT( f->d_file );
-        parseAndResolve(f);
+        files.append(f);
+    }
+    d_filesTotal = files.size();
+    const QString indexPath = QDir::cleanPath(rootDir) + ".lpindex";
+    QList<CodeFile*> stale = files;
+    if( d_useIndex )
+    {
+        CodeIndexReader in;
+        Restored r;
+        if( in.open(indexPath) )
+        {
+            prefetch(files); // isFresh needs the content hashes
+            stale = restoreUnits(in, files, r);
+            parseFiles(stale);
+            restoreSymbols(in, r);
+        }else
+            parseFiles(files);
+    }else
+        parseFiles(files);
+    foreach( Slot* s, fileSlots )
+    {
+        CodeFile* f = static_cast<CodeFile*>(s->d_thing);
         for( int i = 0; i < f->d_includes.size(); i++ )
             new Slot(s, f->d_includes[i]);
     }
     endResetModel();
+    if( d_cancel.load() )
+        return false;
+    if( d_sharedCount )
+        qDebug() << "shared the results of" << d_sharedCount << "duplicate files, saved" << d_sharedBytes
+                 << "bytes and about" << d_sharedTime << "[ms]";
+    if( d_useIndex && !stale.isEmpty() )
+    {
+        if( stale.size() < files.size() )
+            qDebug() << "restored" << files.size() - stale.size() << "files from the index, parsed" << stale.size();
+        saveIndex(indexPath);
+    }
     return true;
 }
 
@@ -766,24 +893,68 @@ const Thing* CodeModel::getThing(const QModelIndex& index) const
     return s->d_thing;
 }
 
-Symbol*CodeModel::findSymbolBySourcePos(const QString& path, int line, int col) const
+static bool symbolBefore(const Symbol& lhs, const RowCol& rhs)
+{
+    return lhs.d_loc.d_row < rhs.d_row || ( lhs.d_loc.d_row == rhs.d_row && lhs.d_loc.d_col < rhs.d_col );
+}
+
+Symbol CodeModel::findSymbolBySourcePos(const QString& path, int line, int col)
 {
     CodeFile* cf = d_map2.value(path);
     if( cf == 0 )
-        return 0;
-    foreach( Symbol* s, cf->d_syms )
-    {
-        if( s->d_decl && s->d_loc.d_row == line &&
-                s->d_loc.d_col <= col && col < s->d_loc.d_col + s->d_decl->getLen() )
-            return s;
-    }
+        return Symbol();
+    if( cf->d_same )
+        cf = cf->d_same;
+    parseBodies(cf);
+    // d_syms is sorted by row/col; only the symbols of the given line up to col can match
+    const Symbol* end = cf->d_syms.constData() + cf->d_syms.size();
+    const Symbol* i = std::lower_bound(cf->d_syms.constData(), end, RowCol(line,0), symbolBefore );
+    for( ; i != end && i->d_loc.d_row == line && i->d_loc.d_col <= col; ++i )
+    {
+        if( i->d_decl && col < i->d_loc.d_col + i->d_len )
+            return *i;
+    }
+    return Symbol();
+}
 
-    return 0; // TODO
+static bool commentBefore( const PpLexer::Comment& c, const RowCol& loc )
+{
+    return c.d_loc.d_row < loc.d_row || ( c.d_loc.d_row == loc.d_row && c.d_loc.d_col < loc.d_col );
 }
 
-CodeFile*CodeModel::getCodeFile(const QString& path) const
+QByteArray CodeModel::findComment(const Declaration* d) const
 {
-    return d_map2.value(path);
+    if( d == 0 )
+        return QByteArray();
+    const QString path = d->getFilePath();
+    QHash<QString,PpLexer::Comments>::const_iterator list = d_comments.find(path);
+    if( list == d_comments.end() )
+        return QByteArray();
+    PpLexer::Comments::const_iterator i = std::lower_bound(list.value().begin(), list.value().end(),
+                                                           d->d_loc, commentBefore);
+    const PpLexer::Comment* hit = 0;
+    if( i != list.value().begin() && (i-1)->d_endRow + 1 >= d->d_loc.d_row )
+        hit = &*(i-1);
+    else if( i != list.value().end() && i->d_loc.d_row == d->d_loc.d_row )
+        hit = &*i;
+    if( hit == 0 )
+        return QByteArray();
+    const FileSystem::File* f = d_fs->findFile(path);
+    if( f == 0 )
+        return QByteArray();
+    const QByteArray content = d_fs->getContent(f);
+    return QByteArray(content.constData() + qMin(int(hit->d_pos), content.size()),
+                      qMax(0, qMin(int(hit->d_len), content.size() - int(hit->d_pos))));
+}
+
+CodeFile*CodeModel::getCodeFile(const QString& path)
+{
+    CodeFile* cf = d_map2.value(path);
+    if( cf && cf->d_same )
+        cf = cf->d_same;
+    if( cf )
+        parseBodies(cf);
+    return cf;
 }
 
 QVariant CodeModel::data(const QModelIndex& index, int role) const
@@ -887,12 +1058,25 @@ Qt::ItemFlags CodeModel::flags(const QModelIndex& index) const
     return Qt::ItemIsEnabled | Qt::ItemIsSelectable; //  | Qt::ItemIsDragEnabled;
 }
 
+void CodeModel::parseFiles(const QList<CodeFile*>& files)
+{
+    prefetch(files);
+    if( d_parallel )
+        parseParallel(files);
+    else
+        foreach( CodeFile* f, files )
+            parseAndResolve(f);
+}
+
 void CodeModel::parseAndResolve(CodeFile* file)
 {
     if( file->d_file->d_parsed )
         return; // already done
+    // mark before resolving, so import cycles end here
+    const_cast<FileSystem::File*>(file->d_file)->d_parsed = true;
 
-    QByteArrayList usedNames = file->findUses();
+    UnitResult res;
+    const QByteArrayList& usedNames = file->d_file->d_uses;
     for( int i = 0; i < usedNames.size(); i++ )
     {
         const FileSystem::File* u = d_fs->findModule(file->d_file->d_dir,usedNames[i].toLower());
@@ -905,43 +1089,1175 @@ void CodeModel::parseAndResolve(CodeFile* file)
         {
             CodeFile* tmp = d_map1.value(u);
             Q_ASSERT( tmp );
-            file->d_import.append( tmp );
             parseAndResolve(tmp);
+            file->d_import.append( tmp->d_same ? tmp->d_same : tmp );
         }
     }
 
-    const_cast<FileSystem::File*>(file->d_file)->d_parsed = true;
-    PpLexer lex(d_fs);
-    lex.reset(file->d_file->d_realPath);
-    Parser p(&lex);
-    p.RunParser();
-    const int off = d_fs->getRootPath().size();
-    if( !p.errors.isEmpty() )
+    if( d_cancel.load() )
+        return;
+    if( !shareResults(file, res) )
+        parseUnit(file, res);
+    commit(res);
+    progress(1, res.d_sloc);
+}
+
+void CodeModel::resolveImports(CodeFile* file, CodeModel::UnitResult& res)
+{
+    // the used units are already done
+    const QByteArrayList& usedNames = file->d_file->d_uses;
+    for( int i = 0; i < usedNames.size(); i++ )
     {
-        foreach( const Parser::Error& e, p.errors )
+        const FileSystem::File* u = d_fs->findModule(file->d_file->d_dir,usedNames[i].toLower());
+        if( u == 0 )
+            res.d_msgs << tr("%1: cannot resolve referenced unit '%2'")
+                    .arg( file->d_file->getVirtualPath(false) ).arg(usedNames[i].constData());
+        else
         {
-            const FileSystem::File* f = d_fs->findFile(e.path);
-            const QString line = tr("%1:%2:%3: %4").arg( f ? f->getVirtualPath() : e.path.mid(off) ).arg(e.row)
-                    .arg(e.col).arg(e.msg);
-            qCritical() << line.toUtf8().constData();
+            CodeFile* tmp = d_map1.value(u);
+            Q_ASSERT( tmp );
+            file->d_import.append( tmp->d_same ? tmp->d_same : tmp );
         }
+    }
+}
 
+static void copyIncludes(CodeFile* copy)
+{
+    // the copy lists the includes of its original with the same SLOC, as if it was parsed itself
+    const CodeFile* orig = copy->d_same;
+    Q_ASSERT( orig != 0 && copy->d_includes.isEmpty() );
+    foreach( const IncludeFile* inc, orig->d_includes )
+    {
+        IncludeFile* tmp = new IncludeFile(*inc);
+        tmp->d_includer = copy;
+        copy->d_includes.append(tmp);
     }
+    copy->d_sloc = orig->d_sloc;
+}
+
+bool CodeModel::shareResults(CodeFile* file, UnitResult& res)
+{
+    QMutexLocker lock(&d_lock);
+    const QList<CodeFile*> candidates = d_byHash.value(d_fs->getHash(file->d_file));
+    lock.unlock();
+    // most recently parsed first
+    for( int i = candidates.size() - 1; i >= 0; i-- )
+    {
+        CodeFile* other = candidates[i];
+        if( canShare(other, file, file->d_import) )
+        {
+            const qint64 bytes = d_fs->getContent(file->d_file).size();
+            lock.relock();
+            file->d_same = other;
+            d_sharedCount++;
+            d_sharedBytes += bytes;
+            d_sharedTime += other->d_parseTime;
+            lock.unlock();
+            copyIncludes(file);
+            res.d_sloc = file->d_sloc;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CodeModel::parseUnit(CodeFile* file, CodeModel::UnitResult& res)
+{
+    QElapsedTimer timer;
+    timer.start();
+    PpLexer lex(d_fs);
+    lex.setCollectComments(d_collectComments);
+    lex.reset(file->d_file->d_realPath);
+    Parser p(&lex);
+    p.d_deferBodies = d_lazyBodies;
+    p.RunParser();
+    errorLines(d_fs,p,res.d_msgs);
     foreach( const PpLexer::Include& f, lex.getIncludes() )
     {
         IncludeFile* inc = new IncludeFile();
         inc->d_file = f.d_file;
+        if( f.d_includer == file->d_file )
+            inc->d_directive = f.d_directive;
         inc->d_loc = f.d_loc;
         inc->d_len = f.d_len;
         inc->d_includer = file;
         file->d_includes.append(inc);
     }
-    d_sloc += lex.getSloc();
+    res.d_sloc = lex.getSloc();
+    file->d_sloc = res.d_sloc;
+    res.d_comments = lex.getComments();
 
     CodeModelVisitor v(this);
+    foreach( const Parser::Deferred& d, p.d_deferred )
+        v.d_deferred.insert(d.d_node,d.d_state);
     v.visit(file,&p.d_root);
+    file->sortSymbols();
+    res.d_file = file;
+    res.d_symDecls = v.d_symDecls;
+    res.d_resolveNs = v.d_resolveNs;
+
+    file->d_parseTime = timer.elapsed();
+    const quint64 hash = d_fs->getHash(file->d_file);
+    if( hash )
+    {
+        QMutexLocker lock(&d_lock);
+        QList<CodeFile*>& list = d_byHash[hash];
+        int i = list.size();
+        while( i > 0 && list[i-1]->d_seq > file->d_seq )
+            i--;
+        list.insert(i, file); // keep the serial order
+    }
+}
+
+void CodeModel::progress(int files, quint32 sloc)
+{
+    d_filesDone += files;
+    d_slocDone += sloc;
+    const qint64 ms = d_loadTimer.elapsed();
+    if( ms - d_lastProgress < 100 && d_filesDone < d_filesTotal )
+        return;
+    d_lastProgress = ms;
+    emit loadProgress(d_filesDone, d_filesTotal, d_slocDone, ms);
+}
+
+void CodeModel::commit(const CodeModel::UnitResult& res)
+{
+    foreach( const QString& line, res.d_msgs )
+        qCritical() << line.toUtf8().constData();
+    d_sloc += res.d_sloc;
+    d_resolveNs += res.d_resolveNs;
+    if( res.d_file )
+        assignIndexes(res.d_file, res.d_symDecls, 0);
+    QHash<QString,PpLexer::Comments>::const_iterator i;
+    for( i = res.d_comments.begin(); i != res.d_comments.end(); ++i )
+    {
+        if( !d_comments.contains(i.key()) )
+            d_comments.insert(i.key(),i.value());
+    }
+}
+
+class UnitJob : public QRunnable
+{
+public:
+    UnitJob(CodeModel::Scheduler* s, int comp):d_sched(s),d_comp(comp){}
+    void run();
+private:
+    CodeModel::Scheduler* d_sched;
+    int d_comp;
+};
+
+struct CodeModel::Scheduler
+{
+    CodeModel* d_mdl;
+    QList<CodeFile*> d_order; // serial parse order, CodeFile::d_seq is the index
+    QVector<UnitResult> d_results; // by d_seq
+    QVector< QList<int> > d_deps; // by d_seq, units which have to be done before
+    QVector<int> d_comp; // by d_seq, strongly connected component
+    QList< QList<int> > d_comps; // members in serial order
+    QVector< QSet<int> > d_dependents; // by component
+    QVector<int> d_waitFor; // by component, number of unfinished components it depends on
+    QMutex d_lock;
+    QWaitCondition d_finished;
+    QList<int> d_done; // finished components not yet processed by run()
+
+    Scheduler(CodeModel* m):d_mdl(m){}
+
+    void order(CodeFile* f)
+    {
+        // the same order in which parseAndResolve reaches the units
+        if( f->d_seq >= 0 )
+            return;
+        f->d_seq = -2; // visiting
+        foreach( const QByteArray& use, f->d_file->d_uses )
+        {
+            const FileSystem::File* u = d_mdl->d_fs->findModule(f->d_file->d_dir,use.toLower());
+            if( u )
+            {
+                CodeFile* tmp = d_mdl->d_map1.value(u);
+                if( tmp && tmp->d_seq == -1 && !tmp->d_file->d_parsed )
+                    order(tmp); // units restored from the index are already done
+            }
+        }
+        f->d_seq = d_order.size();
+        d_order.append(f);
+    }
+
+    void dependencies()
+    {
+        d_deps.resize(d_order.size());
+        QHash<quint64,QList<int> > byHash;
+        foreach( CodeFile* f, d_order )
+        {
+            foreach( const QByteArray& use, f->d_file->d_uses )
+            {
+                const FileSystem::File* u = d_mdl->d_fs->findModule(f->d_file->d_dir,use.toLower());
+                CodeFile* tmp = u ? d_mdl->d_map1.value(u) : 0;
+                if( tmp && tmp != f && tmp->d_seq >= 0 )
+                    d_deps[f->d_seq].append(tmp->d_seq);
+            }
+            // a copy may only be checked against the identical files parsed before it
+            const quint64 hash = d_mdl->d_fs->getHash(f->d_file);
+            if( hash )
+            {
+                QList<int>& same = byHash[hash];
+                d_deps[f->d_seq] += same;
+                same.append(f->d_seq);
+            }
+        }
+    }
+
+    int strongConnect(int v, int& index, QVector<int>& idx, QVector<int>& low, QVector<bool>& onStack,
+                        QList<int>& stack)
+    {
+        // Tarjan; cycles in the uses graph end up in one component
+        idx[v] = low[v] = index++;
+        stack.append(v);
+        onStack[v] = true;
+        foreach( int w, d_deps[v] )
+        {
+            if( idx[w] < 0 )
+            {
+                strongConnect(w, index, idx, low, onStack, stack);
+                low[v] = qMin(low[v], low[w]);
+            }else if( onStack[w] )
+                low[v] = qMin(low[v], idx[w]);
+        }
+        if( low[v] == idx[v] )
+        {
+            QList<int> members;
+            int w;
+            do
+            {
+                w = stack.takeLast();
+                onStack[w] = false;
+                d_comp[w] = d_comps.size();
+                members.append(w);
+            }while( w != v );
+            std::sort(members.begin(), members.end());
+            d_comps.append(members);
+        }
+        return low[v];
+    }
+
+    void components()
+    {
+        const int n = d_order.size();
+        d_comp.fill(-1, n);
+        QVector<int> idx(n, -1), low(n, 0);
+        QVector<bool> onStack(n, false);
+        QList<int> stack;
+        int index = 0;
+        for( int v = 0; v < n; v++ )
+            if( idx[v] < 0 )
+                strongConnect(v, index, idx, low, onStack, stack);
+        d_dependents.resize(d_comps.size());
+        d_waitFor.fill(0, d_comps.size());
+        for( int v = 0; v < n; v++ )
+        {
+            foreach( int w, d_deps[v] )
+            {
+                const int from = d_comp[w], to = d_comp[v];
+                if( from != to && !d_dependents[from].contains(to) )
+                {
+                    d_dependents[from].insert(to);
+                    d_waitFor[to]++;
+                }
+            }
+        }
+    }
+
+    void runComponent(int c)
+    {
+        foreach( int seq, d_comps[c] )
+        {
+            CodeFile* file = d_order[seq];
+            if( d_mdl->d_cancel.load() )
+                break; // still report the component as done so run() terminates
+            const_cast<FileSystem::File*>(file->d_file)->d_parsed = true;
+            d_mdl->resolveImports(file, d_results[seq]);
+            if( !d_mdl->shareResults(file, d_results[seq]) )
+                d_mdl->parseUnit(file, d_results[seq]);
+        }
+        QMutexLocker lock(&d_lock);
+        d_done.append(c);
+        d_finished.wakeOne();
+    }
+
+    void run()
+    {
+        d_results.resize(d_order.size());
+        dependencies();
+        components();
+        QThreadPool pool;
+        for( int c = 0; c < d_comps.size(); c++ )
+            if( d_waitFor[c] == 0 )
+                pool.start(new UnitJob(this, c));
+        int finished = 0;
+        QMutexLocker lock(&d_lock);
+        while( finished < d_comps.size() )
+        {
+            while( d_done.isEmpty() )
+                d_finished.wait(&d_lock);
+            const int c = d_done.takeFirst();
+            finished++;
+            quint32 sloc = 0;
+            foreach( int seq, d_comps[c] )
+                sloc += d_results[seq].d_sloc;
+            d_mdl->progress(d_comps[c].size(), sloc);
+            foreach( int to, d_dependents[c] )
+                if( --d_waitFor[to] == 0 )
+                    pool.start(new UnitJob(this, to));
+        }
+        lock.unlock();
+        pool.waitForDone();
+    }
+};
+
+void UnitJob::run()
+{
+    d_sched->runComponent(d_comp);
+}
+
+void CodeModel::parseParallel(const QList<CodeFile*>& files)
+{
+    Scheduler s(this);
+    foreach( CodeFile* f, files )
+        s.order(f);
+    s.run();
+    // report and merge in the serial order so the result doesn't depend on the schedule
+    for( int i = 0; i < s.d_results.size(); i++ )
+        commit(s.d_results[i]);
+}
+
+static void parseOrder(FileSystem* fs, const FileSystem::File* f, QSet<const FileSystem::File*>& seen,
+                       QList<const FileSystem::File*>& order)
+{
+    // the same order in which parseAndResolve reaches the units
+    if( seen.contains(f) )
+        return;
+    seen.insert(f);
+    foreach( const QByteArray& use, f->d_uses )
+    {
+        const FileSystem::File* u = fs->findModule(f->d_dir,use.toLower());
+        if( u )
+            parseOrder(fs, u, seen, order);
+    }
+    order.append(f);
+}
+
+void CodeModel::prefetch(const QList<CodeFile*>& files)
+{
+    QSet<const FileSystem::File*> seen;
+    QList<const FileSystem::File*> order;
+    foreach( CodeFile* f, files )
+        parseOrder(d_fs, f->d_file, seen, order);
+    for( int i = order.size() - 1; i >= 0; i-- )
+        if( order[i]->d_parsed )
+            order.removeAt(i); // restored from the index
+    if( order.isEmpty() )
+        return;
+    // which include files a unit needs is only known after preprocessing, so read them all after the units
+    for( int i = 0; i < d_fs->getFileCount(); i++ )
+        if( d_fs->getFile(i)->d_type == FileSystem::PascalFragment )
+            order.append(d_fs->getFile(i));
+    d_fs->prefetch(order);
+}
+
+bool CodeModel::canShare(const CodeFile* parsed, const CodeFile* copy, const QList<CodeFile*>& imports) const
+{
+    // same content, so the same uses and $I directives; they must also resolve to the same files
+    if( d_fs->getHash(parsed->d_file) != d_fs->getHash(copy->d_file) || parsed->d_import != imports )
+        return false;
+    if( d_fs->getContent(parsed->d_file) != d_fs->getContent(copy->d_file) )
+        return false; // hash collision
+    foreach( const IncludeFile* inc, parsed->d_includes )
+    {
+        if( !inc->d_directive.isEmpty() &&
+                d_fs->findInclude(copy->d_file->d_dir, inc->d_directive) != inc->d_file )
+            return false;
+    }
+    return true;
+}
+
+void CodeModel::parseBodies(CodeFile* file)
+{
+    if( file->d_deferred.isEmpty() )
+        return;
+    const QList<CodeFile::Deferred> todo = file->d_deferred;
+    file->d_deferred.clear();
+    const int first = file->d_syms.size();
+    CodeModelVisitor v(this);
+    foreach( const CodeFile::Deferred& d, todo )
+    {
+        PpLexer lex(d_fs);
+        if( !lex.restoreState(d.d_state) )
+            continue;
+        Parser p(&lex);
+        SynTree st(SynTree::R_statement_part);
+        p.RunStatementPart(&st);
+        printErrors(d_fs,p);
+        v.deferredBody(file,d.d_scope,&st);
+    }
+    assignIndexes(file, v.d_symDecls, first);
+    d_resolveNs += v.d_resolveNs;
+    file->sortSymbols();
+    d_refsDirty = true;
+}
+
+static quint64 fingerprint(const CodeFile* cf)
+{
+    // covers what importers resolve against: kind and name of each interface declaration in order
+    if( cf->d_intf == 0 )
+        return 0;
+    quint64 h = FileSystem::hashContent(0,0);
+    foreach( const Declaration* d, cf->d_intf->d_order )
+    {
+        const QByteArray name = d->d_name.toLower();
+        h = FileSystem::hashContent((const char*)&d->d_type, 1, h);
+        h = FileSystem::hashContent(name.constData(), name.size() + 1, h); // including the terminating zero
+    }
+    return h;
+}
+
+bool CodeModel::reload(const QList<const FileSystem::File*>& modified)
+{
+    QSet<const FileSystem::File*> changed;
+    foreach( const FileSystem::File* f, modified )
+    {
+        if( !d_fs->refresh(f) )
+            return false;
+        d_includeHashes.remove(f);
+        changed.insert(f);
+    }
+
+    // units and programs to reparse because their source or one of their includes changed
+    QList<CodeFile*> all = d_map1.values();
+    QSet<const CodeFile*> sharing;
+    foreach( CodeFile* cf, all )
+        if( cf->d_same )
+            sharing << cf << cf->d_same;
+    QList<CodeFile*> dirty;
+    foreach( CodeFile* cf, all )
+    {
+        bool hit = changed.contains(cf->d_file);
+        for( int i = 0; !hit && i < cf->d_includes.size(); i++ )
+            hit = changed.contains(cf->d_includes[i]->d_file);
+        if( !hit )
+            continue;
+        if( sharing.contains(cf) )
+            return false; // the content sharing between identical files is only set up by load
+        dirty.append(cf);
+    }
+
+    // reparse in the order load uses, so the used units are done before their users
+    QSet<const FileSystem::File*> seen;
+    QList<const FileSystem::File*> order;
+    foreach( CodeFile* cf, all )
+        parseOrder(d_fs, cf->d_file, seen, order);
+    QHash<const FileSystem::File*,int> pos;
+    for( int i = 0; i < order.size(); i++ )
+        pos.insert(order[i], i);
+    QHash<const CodeFile*,QList<CodeFile*> > importers;
+    foreach( CodeFile* cf, all )
+        foreach( CodeFile* imp, cf->d_import )
+            importers[imp].append(cf);
+
+    QMap<int,CodeFile*> todo;
+    foreach( CodeFile* cf, dirty )
+        todo.insert(pos.value(cf->d_file), cf);
+    QSet<CodeFile*> done;
+    while( !todo.isEmpty() )
+    {
+        CodeFile* cf = todo.take(todo.firstKey());
+        if( done.contains(cf) )
+            continue;
+        done.insert(cf);
+
+        const quint64 before = fingerprint(cf);
+        QVector<quint32> indexes;
+        if( cf->d_intf )
+            foreach( const Declaration* d, cf->d_intf->d_order )
+                indexes.append(d->d_index);
+        Slot* slot = findSlot(&d_root, cf);
+        Q_ASSERT( slot != 0 );
+        if( !slot->d_children.isEmpty() )
+        {
+            beginRemoveRows(indexOf(slot), 0, slot->d_children.size() - 1);
+            foreach( Slot* s, slot->d_children )
+                delete s;
+            slot->d_children.clear();
+            endRemoveRows();
+        }
+        clearUnit(cf);
+
+        UnitResult res;
+        resolveImports(cf, res);
+        parseUnit(cf, res);
+        commit(res);
+        if( !cf->d_includes.isEmpty() )
+        {
+            beginInsertRows(indexOf(slot), 0, cf->d_includes.size() - 1);
+            for( int i = 0; i < cf->d_includes.size(); i++ )
+                new Slot(slot, cf->d_includes[i]);
+            endInsertRows();
+        }
+
+        // the memos of the importers point to the declarations just deleted
+        const QList<CodeFile*> users = importers.value(cf);
+        foreach( CodeFile* user, users )
+            user->d_resolved.clear();
+        if( fingerprint(cf) == before && indexes.size() == ( cf->d_intf ? cf->d_intf->d_order.size() : 0 ) )
+        {
+            // early cutoff: the importers resolve to the same names, just in the new declarations
+            keepIndexes(cf, indexes);
+        }else
+        {
+            // a copy has the same uses as its original, which is queued as well and shares its new results
+            foreach( CodeFile* user, users )
+                if( user->d_same == 0 )
+                    todo.insert(pos.value(user->d_file), user);
+        }
+    }
+    recycleDecls();
+    d_refsDirty = true;
+    return true;
+}
+
+void CodeModel::clearUnit(CodeFile* cf)
+{
+    // everything parseUnit and resolveImports add to a file
+    if( cf->d_intf )
+        freeDecls(cf->d_intf);
+    if( cf->d_impl )
+        freeDecls(cf->d_impl);
+    delete cf->d_intf;
+    cf->d_intf = 0;
+    delete cf->d_impl;
+    cf->d_impl = 0;
+    cf->d_syms.clear();
+    cf->d_deferred.clear();
+    cf->d_import.clear();
+    cf->d_resolved.clear();
+    cf->d_exports.clear();
+    d_comments.remove(cf->d_file->d_realPath);
+    for( int i = 0; i < cf->d_includes.size(); i++ )
+    {
+        d_comments.remove(cf->d_includes[i]->d_file->d_realPath);
+        delete cf->d_includes[i];
+    }
+    cf->d_includes.clear();
+    QHash<quint64,QList<CodeFile*> >::iterator i;
+    for( i = d_byHash.begin(); i != d_byHash.end(); ++i )
+        i.value().removeAll(cf); // the file's hash already changed
+    d_sloc -= cf->d_sloc;
+    cf->d_sloc = 0;
+}
+
+quint32 CodeModel::declIndex(Declaration* d)
+{
+    if( d->d_index == 0 )
+    {
+        if( !d_freeDecls.isEmpty() )
+        {
+            d->d_index = d_freeDecls.last();
+            d_freeDecls.removeLast();
+            d_decls[d->d_index] = d;
+        }else
+        {
+            d->d_index = d_decls.size();
+            d_decls.append(d);
+        }
+    }
+    return d->d_index;
+}
+
+void CodeModel::assignIndexes(CodeFile* cf, const QVector<Declaration*>& local, int first)
+{
+    // serial, so the parser threads don't have to share d_decls
+    QVector<quint32> index(local.size());
+    for( int i = 0; i < local.size(); i++ )
+        index[i] = declIndex(local[i]);
+    for( int i = first; i < cf->d_syms.size(); i++ )
+    {
+        Symbol& sy = cf->d_syms[i];
+        Q_ASSERT( sy.d_decl > 0 && sy.d_decl <= quint32(index.size()) );
+        sy.d_decl = index[sy.d_decl - 1];
+    }
+}
+
+void CodeModel::freeDecls(const Scope* s)
+{
+    foreach( const Declaration* d, s->d_order )
+    {
+        if( d->d_index != 0 )
+        {
+            d_decls[d->d_index] = 0;
+            d_releasedDecls.append(d->d_index);
+        }
+        if( d->d_body )
+            freeDecls(d->d_body);
+    }
+}
+
+void CodeModel::keepIndexes(CodeFile* cf, const QVector<quint32>& old)
+{
+    // give the new interface declarations the indexes the symbols of the importers still refer to
+    QHash<quint32,quint32> remap;
+    for( int i = 0; i < old.size(); i++ )
+    {
+        Declaration* d = cf->d_intf->d_order[i];
+        if( old[i] == 0 )
+            continue;
+        if( d->d_index != 0 )
+        {
+            remap.insert(d->d_index, old[i]);
+            d_decls[d->d_index] = 0;
+            d_releasedDecls.append(d->d_index);
+        }
+        d->d_index = old[i];
+        d_decls[old[i]] = d;
+    }
+    if( remap.isEmpty() )
+        return;
+    for( int i = 0; i < cf->d_syms.size(); i++ )
+    {
+        Symbol& sy = cf->d_syms[i];
+        sy.d_decl = remap.value(sy.d_decl, sy.d_decl);
+    }
+}
+
+void CodeModel::recycleDecls()
+{
+    // symbols of not yet reparsed importers and keepIndexes still use the freed indexes until the
+    // reload is done; only then they can be handed out again
+    foreach( quint32 i, d_releasedDecls )
+        if( d_decls[i] == 0 )
+            d_freeDecls.append(i);
+    d_releasedDecls.clear();
+}
+
+quint64 CodeModel::includeHash(const FileSystem::File* f) const
+{
+    QHash<const FileSystem::File*,quint64>::const_iterator i = d_includeHashes.find(f);
+    if( i != d_includeHashes.end() )
+        return i.value();
+    const QByteArray content = d_fs->getContent(f);
+    const quint64 h = FileSystem::hashContent(content.constData(), content.size());
+    d_includeHashes.insert(f, h);
+    return h;
+}
+
+static QList<CodeFile*> usedFiles(FileSystem* fs, const QHash<const FileSystem::File*,CodeFile*>& map,
+                                  const CodeFile* cf)
+{
+    // what resolveImports finds, but before the sharing between identical files is known
+    QList<CodeFile*> res;
+    foreach( const QByteArray& use, cf->d_file->d_uses )
+    {
+        const FileSystem::File* u = fs->findModule(cf->d_file->d_dir,use.toLower());
+        CodeFile* tmp = u ? map.value(u) : 0;
+        if( tmp )
+            res.append(tmp);
+    }
+    return res;
+}
 
-    QCoreApplication::processEvents();
+QList<CodeFile*> CodeModel::restoreUnits(const CodeIndexReader& in, const QList<CodeFile*>& files,
+                                         CodeModel::Restored& r)
+{
+    // take over the scopes and includes of all files which didn't change since the index was written
+    r.d_files.fill(0, in.getFileCount());
+    r.d_decls.fill(0, in.getDeclCount());
+    r.d_scopes.fill(0, in.getScopeCount());
+    for( quint32 i = 0; i < in.getFileCount(); i++ )
+        r.d_imports.append(QList<CodeFile*>());
+    for( quint32 i = 0; i < in.getFileCount(); i++ )
+    {
+        if( d_cancel.load() )
+            break;
+        const CodeIndex::FileRec rec = in.getFile(i);
+        CodeFile* cf = d_map2.value(QString::fromUtf8(in.getString(rec.d_path)));
+        if( cf == 0 || r.d_records.contains(cf) )
+            continue;
+        r.d_records.insert(cf, i);
+        r.d_imports[i] = usedFiles(d_fs, d_map1, cf);
+        if( !isFresh(in, i, cf, r) )
+            continue;
+        r.d_files[i] = cf;
+        const_cast<FileSystem::File*>(cf->d_file)->d_parsed = true;
+        foreach( CodeFile* imp, r.d_imports[i] )
+            cf->d_import.append( imp->d_same ? imp->d_same : imp );
+        if( rec.d_same != CodeIndex::None )
+        {
+            cf->d_same = r.d_files[rec.d_same];
+            copyIncludes(cf);
+            d_sloc += cf->d_sloc;
+            progress(1, cf->d_sloc);
+            continue;
+        }
+        if( rec.d_intf != CodeIndex::None )
+        {
+            cf->d_intf = restoreScope(in, rec.d_intf, cf, 0, r);
+            cf->buildExports();
+        }
+        if( rec.d_impl != CodeIndex::None )
+            cf->d_impl = restoreScope(in, rec.d_impl, cf, 0, r);
+        foreach( const CodeIndex::DeferredRec& dr, in.getDeferred(rec) )
+        {
+            // the statement parts still deferred when the index was written stay deferred
+            Scope* s = dr.d_scope < quint32(r.d_scopes.size()) ? r.d_scopes[dr.d_scope] : 0;
+            if( s == 0 || s->getCodeFile() != cf )
+                continue;
+            CodeFile::Deferred d;
+            d.d_scope = s;
+            d.d_state = dr.d_state;
+            cf->d_deferred.append(d);
+        }
+        for( quint32 j = 0; j < rec.d_includeCount; j++ )
+        {
+            const CodeIndex::IncludeRec ir = in.getInclude(rec.d_firstInclude + j);
+            IncludeFile* inc = new IncludeFile();
+            inc->d_file = d_fs->findFile(QString::fromUtf8(in.getString(ir.d_path)));
+            if( ir.d_directive != CodeIndex::None )
+            {
+                const QByteArray dir = in.getString(ir.d_directive);
+                inc->d_directive = QByteArray(dir.constData(), dir.size()); // detach from the mapping
+            }
+            inc->d_loc = ir.d_loc;
+            inc->d_len = ir.d_len;
+            inc->d_includer = cf;
+            cf->d_includes.append(inc);
+        }
+        if( d_collectComments )
+        {
+            const QHash<quint32,PpLexer::Comments> comments = in.getComments(rec);
+            QHash<quint32,PpLexer::Comments>::const_iterator c;
+            for( c = comments.begin(); c != comments.end(); ++c )
+            {
+                const QString path = QString::fromUtf8(in.getString(c.key()));
+                if( !d_comments.contains(path) )
+                    d_comments.insert(path, c.value());
+            }
+        }
+        cf->d_sloc = rec.d_sloc;
+        d_sloc += rec.d_sloc;
+        d_byHash[d_fs->getHash(cf->d_file)].append(cf);
+        progress(1, rec.d_sloc);
+    }
+    QList<CodeFile*> stale;
+    foreach( CodeFile* cf, files )
+        if( !cf->d_file->d_parsed )
+            stale.append(cf);
+    return stale;
+}
+
+bool CodeModel::isFresh(const CodeIndexReader& in, quint32 record, const CodeFile* cf, const Restored& r)
+{
+    const CodeIndex::FileRec rec = in.getFile(record);
+    const quint64 hash = d_fs->getHash(cf->d_file);
+    if( hash == 0 || hash != rec.d_hash )
+        return false;
+    if( d_collectComments && rec.d_same == CodeIndex::None && rec.d_commentOff == CodeIndex::None )
+        return false; // written without the comments
+    // the uses clause must still resolve to the same files
+    const QList<CodeFile*>& imports = r.d_imports[record];
+    if( quint32(imports.size()) != rec.d_importCount )
+        return false;
+    for( quint32 j = 0; j < rec.d_importCount; j++ )
+    {
+        const quint32 imp = in.getImport(rec.d_firstImport + j);
+        if( imp >= in.getFileCount() ||
+                QString::fromUtf8(in.getString(in.getFile(imp).d_path)) != imports[j]->d_file->d_realPath )
+            return false;
+    }
+    CodeIndex::FileRec parsed = rec;
+    if( rec.d_same != CodeIndex::None )
+    {
+        // the original must be restored too; the copy takes over its includes, see canShare
+        if( rec.d_same >= record || r.d_files[rec.d_same] == 0 )
+            return false;
+        parsed = in.getFile(rec.d_same);
+    }
+    for( quint32 j = 0; j < parsed.d_includeCount; j++ )
+    {
+        const CodeIndex::IncludeRec ir = in.getInclude(parsed.d_firstInclude + j);
+        const FileSystem::File* f = d_fs->findFile(QString::fromUtf8(in.getString(ir.d_path)));
+        if( f == 0 || includeHash(f) != ir.d_hash )
+            return false;
+        if( ir.d_directive == CodeIndex::None )
+            continue;
+        const QByteArray dir = in.getString(ir.d_directive);
+        // detach, the file system keeps the directive in its lookup cache
+        if( d_fs->findInclude(cf->d_file->d_dir, QByteArray(dir.constData(), dir.size())) != f )
+            return false;
+    }
+    return true;
+}
+
+Scope*CodeModel::restoreScope(const CodeIndexReader& in, quint32 record, Thing* owner, Scope* outer,
+                              CodeModel::Restored& r)
+{
+    const CodeIndex::ScopeRec rec = in.getScope(record);
+    Scope* s = new Scope();
+    s->d_type = rec.d_type;
+    s->d_owner = owner;
+    s->d_outer = outer;
+    r.d_scopes[record] = s;
+    for( quint32 i = rec.d_firstDecl; i < rec.d_firstDecl + rec.d_declCount; i++ )
+    {
+        const CodeIndex::DeclRec dr = in.getDecl(i);
+        const QByteArray name = in.getString(dr.d_name);
+        Declaration* d = new Declaration();
+        d->d_type = dr.d_type;
+        d->d_external = dr.d_external;
+        d->d_name = QByteArray(name.constData(), name.size()); // detach from the mapping
+        d->d_id = Token::toId(d->d_name);
+        d->d_loc = dr.d_loc;
+        d->d_owner = s;
+        s->add(d);
+        r.d_decls[i] = d;
+        // the decls of a body scope follow the ones of the enclosing scope, which also ends the recursion
+        if( dr.d_body != CodeIndex::None && in.getScope(dr.d_body).d_firstDecl > i )
+            d->d_body = restoreScope(in, dr.d_body, d, s, r);
+    }
+    s->freeze();
+    return s;
+}
+
+void CodeModel::restoreSymbols(const CodeIndexReader& in, CodeModel::Restored& r)
+{
+    if( d_cancel.load() )
+        return;
+    // the interface decls of the stale files replace the recorded ones if the importers still resolve to
+    // the same names; otherwise the restored importers have to be parsed again
+    QSet<quint32> changed;
+    QHash<const CodeFile*,quint32>::const_iterator i;
+    for( i = r.d_records.begin(); i != r.d_records.end(); ++i )
+    {
+        if( r.d_files[i.value()] != 0 )
+            continue;
+        const CodeIndex::FileRec rec = in.getFile(i.value());
+        const CodeFile* cf = i.key()->d_same ? i.key()->d_same : i.key();
+        if( rec.d_same != CodeIndex::None )
+            changed.insert(i.value()); // the importers refer to the decls of the original
+        else if( rec.d_intf != CodeIndex::None && cf->d_intf && fingerprint(cf) == rec.d_fingerprint &&
+                 in.getScope(rec.d_intf).d_declCount == quint32(cf->d_intf->d_order.size()) )
+        {
+            const quint32 first = in.getScope(rec.d_intf).d_firstDecl;
+            for( int j = 0; j < cf->d_intf->d_order.size(); j++ )
+                r.d_decls[first + j] = cf->d_intf->d_order[j];
+        }else if( rec.d_intf != CodeIndex::None || cf->d_intf )
+            changed.insert(i.value());
+    }
+
+    QList<CodeFile*> reparse;
+    QSet<const CodeFile*> reparsed;
+    for( quint32 f = 0; f < quint32(r.d_files.size()); f++ )
+    {
+        CodeFile* cf = r.d_files[f];
+        if( cf == 0 || cf->d_same )
+            continue;
+        const CodeIndex::FileRec rec = in.getFile(f);
+        for( quint32 j = 0; j < rec.d_importCount; j++ )
+        {
+            if( changed.contains(in.getImport(rec.d_firstImport + j)) )
+            {
+                reparse.append(cf);
+                reparsed.insert(cf);
+                break;
+            }
+        }
+    }
+    foreach( CodeFile* cf, reparse )
+    {
+        // the own source didn't change, so neither does the interface; stale symbols of other files might
+        // already refer to it by index
+        const CodeIndex::FileRec rec = in.getFile(r.d_records.value(cf));
+        QVector<quint32> indexes;
+        if( cf->d_intf )
+            foreach( const Declaration* d, cf->d_intf->d_order )
+                indexes.append(d->d_index);
+        clearUnit(cf);
+        UnitResult res;
+        resolveImports(cf, res);
+        parseUnit(cf, res);
+        commit(res);
+        if( rec.d_intf == CodeIndex::None )
+            continue;
+        const CodeIndex::ScopeRec sr = in.getScope(rec.d_intf);
+        const bool same = cf->d_intf && fingerprint(cf) == rec.d_fingerprint &&
+                quint32(cf->d_intf->d_order.size()) == sr.d_declCount;
+        if( same )
+            keepIndexes(cf, indexes);
+        for( quint32 j = 0; j < sr.d_declCount; j++ )
+            r.d_decls[sr.d_firstDecl + j] = same ? cf->d_intf->d_order[j] : 0;
+    }
+
+    for( quint32 f = 0; f < quint32(r.d_files.size()); f++ )
+    {
+        CodeFile* cf = r.d_files[f];
+        if( cf == 0 )
+            continue;
+        // the sharing between identical files is complete now
+        cf->d_import.clear();
+        foreach( CodeFile* imp, r.d_imports[f] )
+            cf->d_import.append( imp->d_same ? imp->d_same : imp );
+        if( cf->d_same || reparsed.contains(cf) )
+            continue;
+        const QVector<CodeIndex::SymRec> syms = in.getSymbols(in.getFile(f));
+        cf->d_syms.reserve(syms.size());
+        foreach( const CodeIndex::SymRec& s, syms )
+        {
+            Declaration* d = s.d_decl != 0 && s.d_decl <= quint32(r.d_decls.size()) ? r.d_decls[s.d_decl - 1] : 0;
+            if( d == 0 )
+                continue;
+            Symbol sy;
+            sy.d_decl = declIndex(d);
+            sy.d_loc = s.d_loc;
+            sy.d_len = d->getLen();
+            cf->d_syms.append(sy);
+        }
+    }
+    recycleDecls();
+    d_refsDirty = true;
+}
+
+static quint32 writeScope(CodeIndexWriter& out, const Scope* s, QHash<const Declaration*,quint32>& decls,
+                          QHash<const Scope*,quint32>& scopes)
+{
+    const quint32 res = out.d_scopes.size();
+    scopes.insert(s, res);
+    CodeIndex::ScopeRec sr;
+    sr.d_type = s->d_type;
+    sr.d_firstDecl = out.d_decls.size();
+    sr.d_declCount = s->d_order.size();
+    out.d_scopes.append(sr);
+    out.d_decls.resize(sr.d_firstDecl + sr.d_declCount);
+    for( int i = 0; i < s->d_order.size(); i++ )
+    {
+        const Declaration* d = s->d_order[i];
+        CodeIndex::DeclRec dr;
+        dr.d_name = out.intern(d->d_name);
+        dr.d_loc = d->d_loc;
+        dr.d_type = d->d_type;
+        dr.d_external = d->d_external;
+        if( d->d_body )
+            dr.d_body = writeScope(out, d->d_body, decls, scopes);
+        decls.insert(d, sr.d_firstDecl + i);
+        out.d_decls[sr.d_firstDecl + i] = dr;
+    }
+    return res;
+}
+
+bool CodeModel::saveIndex(const QString& path)
+{
+    // the statement parts still deferred are recorded as such, so writing the index doesn't parse them
+    QList<CodeFile*> files;
+    foreach( CodeFile* cf, d_map1.values() )
+        if( cf->d_same == 0 )
+            files.append(cf);
+    QHash<const CodeFile*,quint32> records;
+    foreach( CodeFile* cf, files )
+        records.insert(cf, records.size());
+    foreach( CodeFile* cf, d_map1.values() )
+        if( cf->d_same )
+        {
+            records.insert(cf, files.size());
+            files.append(cf); // copies after the originals
+        }
+
+    CodeIndexWriter out;
+    QHash<const Declaration*,quint32> decls;
+    QHash<const Scope*,quint32> scopes;
+    out.d_files.resize(files.size());
+    for( int i = 0; i < files.size(); i++ )
+    {
+        const CodeFile* cf = files[i];
+        CodeIndex::FileRec& rec = out.d_files[i];
+        rec.d_path = out.intern(cf->d_file->d_realPath.toUtf8());
+        rec.d_hash = d_fs->getHash(cf->d_file);
+        rec.d_firstImport = out.d_imports.size();
+        foreach( CodeFile* imp, usedFiles(d_fs, d_map1, cf) )
+            out.d_imports.append(records.value(imp));
+        rec.d_importCount = out.d_imports.size() - rec.d_firstImport;
+        if( cf->d_same )
+        {
+            rec.d_same = records.value(cf->d_same);
+            continue;
+        }
+        rec.d_fingerprint = fingerprint(cf);
+        rec.d_sloc = cf->d_sloc;
+        if( cf->d_intf )
+            rec.d_intf = writeScope(out, cf->d_intf, decls, scopes);
+        if( cf->d_impl )
+            rec.d_impl = writeScope(out, cf->d_impl, decls, scopes);
+        QList<CodeIndex::DeferredRec> deferred;
+        foreach( const CodeFile::Deferred& d, cf->d_deferred )
+            deferred.append(CodeIndex::DeferredRec(scopes.value(d.d_scope, CodeIndex::None), d.d_state));
+        out.addDeferred(rec, deferred);
+        rec.d_firstInclude = out.d_includes.size();
+        foreach( const IncludeFile* inc, cf->d_includes )
+        {
+            CodeIndex::IncludeRec ir;
+            ir.d_path = out.intern(inc->d_file->d_realPath.toUtf8());
+            if( !inc->d_directive.isEmpty() )
+                ir.d_directive = out.intern(inc->d_directive);
+            ir.d_loc = inc->d_loc;
+            ir.d_len = inc->d_len;
+            ir.d_hash = includeHash(inc->d_file);
+            out.d_includes.append(ir);
+        }
+        rec.d_includeCount = out.d_includes.size() - rec.d_firstInclude;
+        if( d_collectComments )
+        {
+            QHash<quint32,PpLexer::Comments> comments;
+            QStringList paths;
+            paths << cf->d_file->d_realPath;
+            foreach( const IncludeFile* inc, cf->d_includes )
+                paths << inc->d_file->d_realPath;
+            foreach( const QString& p, paths )
+            {
+                QHash<QString,PpLexer::Comments>::const_iterator c = d_comments.find(p);
+                if( c != d_comments.end() )
+                    comments.insert(out.intern(p.toUtf8()), c.value());
+            }
+            out.addComments(rec, comments);
+        }
+    }
+    // the symbols may refer to the decls of any file
+    for( int i = 0; i < files.size(); i++ )
+    {
+        const CodeFile* cf = files[i];
+        if( cf->d_same )
+            continue;
+        QVector<CodeIndex::SymRec> syms;
+        syms.reserve(cf->d_syms.size());
+        foreach( const Symbol& sy, cf->d_syms )
+        {
+            QHash<const Declaration*,quint32>::const_iterator d = decls.find(getDecl(sy.d_decl));
+            if( d != decls.end() )
+                syms.append(CodeIndex::SymRec(sy.d_loc, d.value() + 1));
+        }
+        out.addSymbols(out.d_files[i], syms);
+    }
+    if( !out.write(path) )
+    {
+        qWarning() << "cannot write code index:" << out.getError();
+        return false;
+    }
+    return true;
+}
+
+CodeModel::Slot*CodeModel::findSlot(Slot* s, const Thing* t) const
+{
+    if( s->d_thing == t )
+        return s;
+    foreach( Slot* sub, s->d_children )
+    {
+        if( sub->d_thing == 0 || sub->d_thing->d_type == Thing::Folder || sub->d_thing == t )
+        {
+            Slot* res = findSlot(sub, t);
+            if( res )
+                return res;
+        }
+    }
+    return 0;
+}
+
+QModelIndex CodeModel::indexOf(Slot* s) const
+{
+    if( s == &d_root || s->d_parent == 0 )
+        return QModelIndex();
+    return createIndex(s->d_parent->d_children.indexOf(s), 0, s);
+}
+
+CodeModel::Refs CodeModel::findRefs(const Declaration* d, const CodeFile* cf) const
+{
+    Refs res;
+    if( d == 0 || d->d_index == 0 || cf == 0 )
+        return res;
+    if( cf->d_same )
+        cf = cf->d_same;
+    if( d_refsDirty )
+        buildRefIndex();
+    if( d->d_index + 1 >= quint32(d_refGroups.size()) )
+        return res;
+    for( quint32 g = d_refGroups[d->d_index]; g < d_refGroups[d->d_index + 1]; g++ )
+    {
+        if( d_refFiles[g] == cf )
+        {
+            res.d_first = d_refLocs.constData() + d_refStart[g];
+            res.d_count = d_refStart[g + 1] - d_refStart[g];
+            break;
+        }
+    }
+    return res;
+}
+
+void CodeModel::buildRefIndex() const
+{
+    // two passes over all symbols, the first counts, the second fills; the symbols of a file
+    // are sorted, so are the positions in each group
+    d_refsDirty = false;
+    const int n = d_decls.size();
+    QVector<quint32> groups(n + 1, 0);
+    QVector<quint32> refs(n + 1, 0);
+    QVector<const CodeFile*> last(n, 0);
+    QList<CodeFile*> files = d_map1.values();
+    foreach( const CodeFile* cf, files )
+    {
+        if( cf->d_same )
+            continue;
+        for( int i = 0; i < cf->d_syms.size(); i++ )
+        {
+            const quint32 d = cf->d_syms[i].d_decl;
+            if( d == 0 )
+                continue;
+            refs[d]++;
+            if( last[d] != cf )
+            {
+                last[d] = cf;
+                groups[d]++;
+            }
+        }
+    }
+    // prefix sums; groups and refs now hold the next free slot per decl
+    d_refGroups.resize(n + 1);
+    quint32 g = 0, r = 0;
+    for( int d = 0; d < n; d++ )
+    {
+        d_refGroups[d] = g;
+        g += groups[d];
+        groups[d] = d_refGroups[d];
+        const quint32 count = refs[d];
+        refs[d] = r;
+        r += count;
+    }
+    d_refGroups[n] = g;
+    d_refFiles.resize(g);
+    d_refStart.resize(g + 1);
+    d_refStart[g] = r;
+    d_refLocs.resize(r);
+    last.fill(0);
+    foreach( CodeFile* cf, files )
+    {
+        if( cf->d_same )
+            continue;
+        for( int i = 0; i < cf->d_syms.size(); i++ )
+        {
+            const Symbol& sy = cf->d_syms[i];
+            if( sy.d_decl == 0 )
+                continue;
+            if( last[sy.d_decl] != cf )
+            {
+                last[sy.d_decl] = cf;
+                const quint32 k = groups[sy.d_decl]++;
+                d_refFiles[k] = cf;
+                d_refStart[k] = refs[sy.d_decl];
+            }
+            d_refLocs[refs[sy.d_decl]++] = sy.d_loc;
+        }
+    }
 }
 
 bool CodeModel::lessThan(const CodeModel::Slot* lhs, const CodeModel::Slot* rhs)
@@ -984,74 +2300,97 @@ QString CodeFile::getName() const
     return d_file->d_name;
 }
 
-QByteArrayList CodeFile::findUses() const
-{
-    QByteArrayList res;
-    if( d_file == 0 || !(d_file->d_type == FileSystem::PascalProgram ||
-                         d_file->d_type == FileSystem::PascalUnit) )
-        return res;
-    QFile f(d_file->d_realPath);
-    f.open(QIODevice::ReadOnly);
-    Lexer lex;
-    lex.setStream(&f);
-    Token t = lex.nextToken();
-    while( t.isValid() )
-    {
-        switch( t.d_type )
-        {
-        case Tok_uses:
-            t = lex.nextToken();
-            while( t.isValid() && t.d_type != Tok_Semi )
-            {
-                if( t.d_type == Tok_Comma )
-                {
-                    t = lex.nextToken();
-                    continue;
-                }
-                if( t.d_type == Tok_identifier )
-                {
-                    const QByteArray id = t.d_val;
-                    t = lex.nextToken();
-                    if( t.d_type == Tok_Slash )
-                    {
-                        t = lex.nextToken();
-                        if( t.d_type == Tok_identifier ) // just to make sure
-                        {
-                            res.append( t.d_val );
-                            t = lex.nextToken();
-                        }
-                    }else
-                        res.append(id);
-                }else
-                    t = lex.nextToken();
-            }
-            return res;
-        case Tok_label:
-        case Tok_var:
-        case Tok_const:
-        case Tok_type:
-        case Tok_procedure:
-        case Tok_function:
-        case Tok_implementation:
-            return res;
-        }
-        t = lex.nextToken();
-    }
-    return res;
-}
-
 CodeFile::~CodeFile()
 {
     if( d_impl )
         delete d_impl;
     if( d_intf )
         delete d_intf;
-    for( int i = 0; i < d_syms.size(); i++ )
-        delete d_syms[i];
     for( int i = 0; i < d_includes.size(); i++ )
         delete d_includes[i];
 }
 
+static bool symbolLessThan(const Symbol& lhs, const Symbol& rhs)
+{
+    return symbolBefore(lhs, rhs.d_loc);
+}
+
+void CodeFile::sortSymbols()
+{
+    // stable, so symbols at the same position (e.g. from includes) keep the order they were found
+    std::stable_sort(d_syms.begin(), d_syms.end(), symbolLessThan);
+}
+
+static inline quint64 bloomHash(quint32 id)
+{
+    // the splitmix64 finalizer; both 32 bit halves depend on all bits of the id, so they are
+    // independent probes
+    quint64 z = quint64(id) + Q_UINT64_C(0x9e3779b97f4a7c15);
+    z = ( z ^ ( z >> 30 ) ) * Q_UINT64_C(0xbf58476d1ce4e5b9);
+    z = ( z ^ ( z >> 27 ) ) * Q_UINT64_C(0x94d049bb133111eb);
+    return z ^ ( z >> 31 );
+}
+
+void CodeFile::buildExports()
+{
+    // two probes per atom and about 16 bits per declaration give a false positive rate below 2%
+    d_resolved.clear(); // misses memoized while the interface was open might be declared there
+    d_exports.clear();
+    if( d_intf == 0 || d_intf->d_order.isEmpty() )
+        return;
+    int words = 1;
+    while( words * 64 < d_intf->d_order.size() * 16 )
+        words *= 2;
+    d_exports.fill(0,words);
+    const quint32 mask = words * 64 - 1;
+    foreach( Declaration* d, d_intf->d_order )
+    {
+        const quint64 h = bloomHash(d->d_id);
+        const quint32 a = h & mask;
+        const quint32 b = ( h >> 32 ) & mask;
+        d_exports[a >> 6] |= Q_UINT64_C(1) << ( a & 63 );
+        d_exports[b >> 6] |= Q_UINT64_C(1) << ( b & 63 );
+    }
+}
+
+bool CodeFile::mayExport(quint32 id) const
+{
+    if( d_exports.isEmpty() )
+        return false;
+    const quint32 mask = d_exports.size() * 64 - 1;
+    const quint64 h = bloomHash(id);
+    const quint32 a = h & mask;
+    const quint32 b = ( h >> 32 ) & mask;
+    const quint64* w = d_exports.constData();
+    return ( w[a >> 6] & ( Q_UINT64_C(1) << ( a & 63 ) ) ) && ( w[b >> 6] & ( Q_UINT64_C(1) << ( b & 63 ) ) );
+}
+
+Declaration*CodeFile::findImport(quint32 id)
+{
+    // only called by the thread visiting this file; the imports are complete by then
+    QHash<quint32,Declaration*>::const_iterator i = d_resolved.find(id);
+    if( i != d_resolved.end() )
+        return i.value();
+    Declaration* res = 0;
+    bool complete = true;
+    if( d_impl && d_intf && mayExport(id) )
+        res = d_intf->findLocal(id); // the implementation sees its own interface first
+    for( int j = 0; res == 0 && j < d_import.size(); j++ )
+    {
+        CodeFile* imp = d_import[j];
+        if( imp->d_intf == 0 )
+        {
+            complete = complete && imp->d_file->d_type != FileSystem::PascalUnit; // cycle, not yet visited
+            continue;
+        }
+        if( imp->mayExport(id) )
+            res = imp->d_intf->findLocal(id); // don't follow imports of imports
+    }
+    if( res || complete )
+        d_resolved.insert(id,res);
+    return res;
+}
+
 CodeFile*Scope::getCodeFile() const
 {
     Q_ASSERT( d_owner != 0 );
@@ -1066,47 +2405,106 @@ CodeFile*Scope::getCodeFile() const
         Q_ASSERT(false);
 }
 
-Declaration*Scope::findDecl(const QByteArray& name, bool withImports) const
+void Scope::add(Declaration* d)
 {
-#if 1
-    // Cache effect is about 2-5%, too expensive for effect
-    Declaration* d = d_cache.value(name);
-    if( d )
-        return d;
-#endif
-    foreach( Declaration* d, d_order )
+    Q_ASSERT( !d_frozen );
+    d_order.append(d);
+    if( d_table.isEmpty() )
+    {
+        if( d_order.size() > SmallScope )
+            rehash(d_order.size());
+    }else if( d_order.size() * 2 > d_table.size() )
+        rehash(d_order.size());
+    else
+        insert(d);
+}
+
+void Scope::freeze()
+{
+    // declarations are looked up while the scope is being filled (declare before use), so big scopes
+    // already have a table; here it is only resized to its final fill so probe sequences stay short
+    if( d_frozen )
+        return;
+    d_frozen = true;
+    if( !d_table.isEmpty() )
+        rehash(d_order.size());
+}
+
+void Scope::rehash(int size)
+{
+    int n = SmallScope * 2;
+    quint8 shift = 32 - 4; // SmallScope * 2 == 1 << 4
+    while( n < size * 2 )
     {
-        if( d->d_name == name )
-        {
-            d_cache.insert(name,d);
-            return d;
-        }
+        n *= 2;
+        shift--;
     }
-    if( d_outer )
-        return d_outer->findDecl(name);
+    if( n == d_table.size() )
+        return;
+    d_table.fill(0,n);
+    d_shift = shift;
+    for( int i = 0; i < d_order.size(); i++ )
+        insert(d_order[i]);
+}
 
-    return 0; // TODO: the following is still too slow (takes ~ 30% longer)
-    if( withImports )
+static inline quint32 slotOf(quint32 id, quint8 shift)
+{
+    // Fibonacci hashing: the high bits of the product depend on all bits of the dense ids
+    return ( id * 2654435761u ) >> shift;
+}
+
+void Scope::insert(Declaration* d)
+{
+    const quint32 mask = d_table.size() - 1;
+    quint32 i = slotOf(d->d_id, d_shift);
+    while( Declaration* other = d_table[i] )
     {
-        CodeFile* cf = getCodeFile();
-        if( cf == 0 )
-            return 0; // TODO: this happens, check
-        foreach( CodeFile* imp, cf->d_import )
+        if( other->d_id == d->d_id )
+            return; // the first declaration wins, as with the linear scan
+        i = ( i + 1 ) & mask;
+    }
+    d_table[i] = d;
+}
+
+Declaration*Scope::findLocal(quint32 id) const
+{
+    if( d_table.isEmpty() )
+    {
+        for( int i = 0; i < d_order.size(); i++ )
         {
-            if( imp->d_intf )
-            {
-                Declaration* d = imp->d_intf->findDecl(name,false); // don't follow imports of imports
-                if( d )
-                {
-                    d_cache.insert(name,d);
-                    return d;
-                }
-            }
+            if( d_order[i]->d_id == id )
+                return d_order[i];
         }
+        return 0;
+    }
+    const quint32 mask = d_table.size() - 1;
+    Declaration* const* table = d_table.constData();
+    quint32 i = slotOf(id, d_shift);
+    while( Declaration* d = table[i] )
+    {
+        if( d->d_id == id )
+            return d;
+        i = ( i + 1 ) & mask;
     }
     return 0;
 }
 
+Declaration*Scope::findDecl(quint32 id, bool withImports) const
+{
+    for( const Scope* s = this; s != 0; s = s->d_outer )
+    {
+        Declaration* d = s->findLocal(id);
+        if( d )
+            return d;
+    }
+    if( !withImports )
+        return 0;
+    CodeFile* cf = getCodeFile();
+    if( cf == 0 )
+        return 0; // TODO: this happens, check
+    return cf->findImport(id);
+}
+
 Scope::~Scope()
 {
     for( int i = 0; i < d_order.size(); i++ )
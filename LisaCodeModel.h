@@ -22,14 +22,20 @@
 
 #include <QAbstractItemModel>
 #include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <QAtomicInt>
+#include <QElapsedTimer>
 #include <FileSystem.h>
 #include "LisaRowCol.h"
+#include "PpLexer.h"
 
 namespace Lisa
 {
 class Scope;
 class CodeFile;
 class Symbol;
+class CodeIndexReader;
 
 class Thing
 {
@@ -61,39 +67,50 @@ public:
     Declaration* d_intf; // points to the twin in the interface if this is in an implementation
     Scope* d_body; // owns
     QByteArray d_name;
+    quint32 d_id; // atom of d_name, see Token::toId
     RowCol d_loc;
     Scope* d_owner;
-    QHash<CodeFile*,QList<Symbol*> > d_refs;
+    quint32 d_index; // in CodeModel::d_decls, 0 until first referenced
 
     RowCol getLoc() const { return d_loc; }
     QString getFilePath() const;
     quint16 getLen() const { return d_name.size(); }
     QString getName() const;
     CodeFile* getCodeFile() const;
-    Declaration():d_impl(0),d_intf(0),d_body(0),d_owner(0){}
+    Declaration():d_impl(0),d_intf(0),d_body(0),d_id(0),d_owner(0),d_index(0){}
     ~Declaration();
 };
 
 class Scope : public Thing
 {
 public:
+    enum { SmallScope = 8 }; // up to this size a linear scan of d_order beats hashing
     QList<Declaration*> d_order; // owns
+    QVector<Declaration*> d_table; // open addressing by Declaration::d_id, empty for small scopes
     Thing* d_owner; // either declaration or codefile
     Scope* d_outer;
-    mutable QHash<QByteArray,Declaration*> d_cache;
+    bool d_frozen;
+    quint8 d_shift; // 32 - log2 of the d_table size
 
     CodeFile* getCodeFile() const;
-    Declaration* findDecl(const QByteArray& name , bool withImports = true) const;
-    Scope():d_owner(0),d_outer(0){}
+    void add(Declaration*);
+    void freeze(); // no more declarations after this
+    Declaration* findLocal(quint32 id) const;
+    Declaration* findDecl(quint32 id, bool withImports = true) const;
+    Scope():d_owner(0),d_outer(0),d_frozen(false),d_shift(32){}
     ~Scope();
+protected:
+    void rehash(int size);
+    void insert(Declaration*);
 };
 
-class Symbol
+class Symbol // packed 12 byte record, stored by value
 {
 public:
-    Thing* d_decl;
+    quint32 d_decl; // index into CodeModel::d_decls, 0 if none
     RowCol d_loc;
-    Symbol():d_decl(0){}
+    quint16 d_len; // cached length of the declaration name
+    Symbol():d_decl(0),d_len(0){}
 };
 
 class IncludeFile : public Thing
@@ -101,6 +118,7 @@ class IncludeFile : public Thing
 public:
     const FileSystem::File* d_file;
     CodeFile* d_includer;
+    QByteArray d_directive; // only set if directly included by d_includer, not by another include
     RowCol d_loc;
     quint16 d_len;
 
@@ -116,14 +134,29 @@ class CodeFile : public Thing
 public:
     Scope* d_intf; // owns, 0 for Program
     Scope* d_impl; // owns
-    QList<Symbol*> d_syms; // owns, all things we can click on in a code file ordered by row/col
+    QVector<Symbol> d_syms; // all things we can click on in a code file ordered by row/col
     const FileSystem::File* d_file;
     QList<IncludeFile*> d_includes; // owns
     QList<CodeFile*> d_import;
+    struct Deferred
+    {
+        Scope* d_scope;
+        PpLexer::State d_state;
+    };
+    QList<Deferred> d_deferred; // statement parts not yet parsed
+    CodeFile* d_same; // byte identical file in the same context; this file shares its results
+    qint64 d_parseTime; // ms
+    quint32 d_sloc; // of this file and its includes
+    int d_seq; // position in the serial parse order
+    QVector<quint64> d_exports; // Bloom filter of the atoms declared in d_intf
+    QHash<quint32,Declaration*> d_resolved; // memo of findImport, also negative results
 
     QString getName() const;
-    QByteArrayList findUses() const;
-    CodeFile():d_intf(0),d_impl(0),d_file(0) { d_type = File; }
+    void sortSymbols();
+    void buildExports();
+    bool mayExport(quint32 id) const;
+    Declaration* findImport(quint32 id);
+    CodeFile():d_intf(0),d_impl(0),d_file(0),d_same(0),d_parseTime(0),d_sloc(0),d_seq(-1) { d_type = File; }
     ~CodeFile();
 };
 
@@ -146,12 +179,30 @@ class CodeModel : public QAbstractItemModel
 public:
     explicit CodeModel(QObject *parent = 0);
 
-    bool load( const QString& rootDir );
+    bool load( const QString& rootDir ); // false if cancelled; can run in a worker thread
+    bool reload( const QList<const FileSystem::File*>& modified ); // false if only a new load can do it
+    void cancel() { d_cancel = 1; } // thread-safe, a running load returns as soon as possible
     const Thing* getThing(const QModelIndex& index) const;
-    Symbol* findSymbolBySourcePos(const QString& path, int line, int col) const;
+    // both parse the deferred statement parts of the file first
+    Symbol findSymbolBySourcePos(const QString& path, int line, int col); // d_decl is 0 if none
+    Declaration* getDecl(quint32 index) const { return index < quint32(d_decls.size()) ? d_decls[index] : 0; }
+    struct Refs
+    {
+        const RowCol* d_first;
+        int d_count;
+        Refs():d_first(0),d_count(0){}
+    };
+    Refs findRefs(const Declaration*, const CodeFile*) const; // ordered by row/col, valid until the next call
     FileSystem* getFs() const { return d_fs; }
     quint32 getSloc() const { return d_sloc; }
-    CodeFile* getCodeFile(const QString& path) const;
+    CodeFile* getCodeFile(const QString& path);
+    void setLazyBodies( bool on ) { d_lazyBodies = on; }
+    void setCollectComments( bool on ) { d_collectComments = on; }
+    QByteArray findComment( const Declaration* ) const; // the comment preceding or on the same line as the decl
+    void setParallel( bool on ) { d_parallel = on; } // parse independent units concurrently
+    void setUseIndex( bool on ) { d_useIndex = on; } // keep the parsed model in <rootDir>.lpindex
+    void setProfile( bool on ) { d_profile = on; } // measure the identifier resolution, see getResolveTime
+    qint64 getResolveTime() const { return d_resolveNs; } // ns in Scope::findDecl incl. findImport since load
 
     // overrides
     int columnCount ( const QModelIndex & parent = QModelIndex() ) const { return 1; }
@@ -161,8 +212,45 @@ public:
     int rowCount ( const QModelIndex & parent = QModelIndex() ) const;
     Qt::ItemFlags flags ( const QModelIndex & index ) const;
 
+    struct Scheduler;
+    struct Restored;
+signals:
+    void loadProgress( int files, int total, quint32 sloc, qint64 ms ); // emitted by the loading thread
 protected:
+    struct UnitResult
+    {
+        QStringList d_msgs;
+        QHash<QString,PpLexer::Comments> d_comments;
+        quint32 d_sloc;
+        CodeFile* d_file; // 0 if not parsed
+        QVector<Declaration*> d_symDecls; // see assignIndexes
+        qint64 d_resolveNs;
+        UnitResult():d_sloc(0),d_file(0),d_resolveNs(0){}
+    };
+    void parseFiles(const QList<CodeFile*>&);
     void parseAndResolve(CodeFile*);
+    void parseParallel(const QList<CodeFile*>&);
+    void resolveImports(CodeFile*, UnitResult&);
+    bool shareResults(CodeFile*, UnitResult&);
+    void parseUnit(CodeFile*, UnitResult&);
+    void commit(const UnitResult&);
+    quint32 declIndex(Declaration*);
+    void assignIndexes(CodeFile*, const QVector<Declaration*>& local, int first);
+    void progress(int files, quint32 sloc);
+    void parseBodies(CodeFile*);
+    void clearUnit(CodeFile*);
+    void freeDecls(const Scope*);
+    void keepIndexes(CodeFile*, const QVector<quint32>& old);
+    void recycleDecls();
+    void buildRefIndex() const;
+    bool canShare(const CodeFile* parsed, const CodeFile* copy, const QList<CodeFile*>& imports) const;
+    QList<CodeFile*> restoreUnits(const CodeIndexReader&, const QList<CodeFile*>&, Restored&);
+    bool isFresh(const CodeIndexReader&, quint32 record, const CodeFile*, const Restored&);
+    Scope* restoreScope(const CodeIndexReader&, quint32 record, Thing* owner, Scope* outer, Restored&);
+    void restoreSymbols(const CodeIndexReader&, Restored&);
+    bool saveIndex(const QString& path);
+    quint64 includeHash(const FileSystem::File*) const;
+    friend class CodeModelVisitor;
 
 private:
     struct Slot
@@ -175,13 +263,47 @@ private:
     };
     static bool lessThan( const Slot* lhs, const Slot* rhs);
     void fillFolders(Slot* root, const FileSystem::Dir* super, CodeFolder* top, QList<Slot*>& fileSlots);
+    void prefetch(const QList<CodeFile*>&);
+    Slot* findSlot(Slot*, const Thing*) const;
+    QModelIndex indexOf(Slot*) const;
     Slot d_root;
     FileSystem* d_fs;
     CodeFolder d_top;
     QHash<const FileSystem::File*,CodeFile*> d_map1;
     QHash<QString,CodeFile*> d_map2; // real path -> file
     quint32 d_sloc; // number of lines of code without empty or comment lines
+    bool d_lazyBodies; // parse statement parts of procedures only when the file is accessed
+    bool d_collectComments;
+    QHash<QString,PpLexer::Comments> d_comments; // real path -> comments
+    QHash<quint64,QList<CodeFile*> > d_byHash; // content hash -> parsed files in serial order
+    QVector<Declaration*> d_decls; // referenced declarations by Declaration::d_index, 0 is unused
+    QVector<quint32> d_freeDecls; // unused d_decls slots, handed out by declIndex
+    QVector<quint32> d_releasedDecls; // freed while reparsing, moved to d_freeDecls by recycleDecls
+    // reverse references in compressed sparse row form: decl index -> groups -> positions;
+    // the references of group g are d_refLocs[d_refStart[g]..d_refStart[g+1])
+    mutable QVector<quint32> d_refGroups; // decl index -> first group, d_decls.size() + 1 entries
+    mutable QVector<CodeFile*> d_refFiles; // group -> referencing file
+    mutable QVector<quint32> d_refStart; // group -> first position, groups + 1 entries
+    mutable QVector<RowCol> d_refLocs;
+    mutable bool d_refsDirty; // symbols were added since the index was built
+    quint32 d_sharedCount;
+    qint64 d_sharedBytes;
+    qint64 d_sharedTime; // ms
+    bool d_parallel;
+    bool d_useIndex;
+    bool d_profile;
+    qint64 d_resolveNs;
+    QAtomicInt d_cancel;
+    QElapsedTimer d_loadTimer;
+    qint64 d_lastProgress; // ms
+    int d_filesDone;
+    int d_filesTotal;
+    quint32 d_slocDone; // d_sloc is only summed up at the end when parsing in parallel
+    QMutex d_lock; // protects d_byHash and the shared counters while parsing in parallel
+    mutable QHash<const FileSystem::File*,quint64> d_includeHashes; // content hashes of include files
 };
 }
 
+Q_DECLARE_TYPEINFO(Lisa::Symbol, Q_PRIMITIVE_TYPE);
+
 #endif // LISACODEMODEL_H
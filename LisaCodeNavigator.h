@@ -22,18 +22,22 @@
 
 #include <QMainWindow>
 #include "LisaRowCol.h"
+#include "FileSystem.h"
 
 class QLabel;
 class QPlainTextEdit;
 class QTreeView;
 class QTreeWidget;
 class QModelIndex;
+class QProgressBar;
+class QPushButton;
 
 namespace Lisa
 {
 class CodeModel;
 class Symbol;
 class Declaration;
+class FileWatcher;
 
 class CodeNavigator : public QMainWindow
 {
@@ -41,6 +45,7 @@ class CodeNavigator : public QMainWindow
 public:
     explicit CodeNavigator(QWidget *parent = 0);
     void open( const QString& sourceTreePath);
+public slots:
     void logMessage(const QString&);
 
 protected:
@@ -59,6 +64,9 @@ protected:
     void createModuleList();
     void createUsedBy();
     void createLog();
+    void createStatus();
+    void installModel( CodeModel* );
+    void dropModelRefs();
     void pushLocation( const Place& );
     void showViewer( const Place& );
     void fillUsedBy(Declaration*);
@@ -78,9 +86,15 @@ protected slots:
     void onGotoDefinition();
     void onOpen();
     void onRunReload();
+    void onLoadProgress( int files, int total, quint32 sloc, qint64 ms );
+    void onLoadFinished();
+    void onCancelLoad();
+    void onFilesChanged( const QStringList& added, const QList<const Lisa::FileSystem::File*>& modified,
+                         const QList<const Lisa::FileSystem::File*>& removed );
 
 private:
     class Viewer;
+    class Loader;
     Viewer* d_view;
     QLabel* d_loc;
     QPlainTextEdit* d_msgLog;
@@ -88,6 +102,12 @@ private:
     QLabel* d_usedByTitle;
     QTreeWidget* d_usedBy;
     CodeModel* d_mdl;
+    Loader* d_loader; // runs while a new model is loaded in the background, 0 otherwise
+    bool d_reloadPending; // files changed while loading, start over when the loader is done
+    QLabel* d_status;
+    QProgressBar* d_progress;
+    QPushButton* d_cancel;
+    FileWatcher* d_watcher;
     QString d_dir;
 
     QList<Place> d_backHisto; // d_backHisto.last() is current place
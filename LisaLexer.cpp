@@ -20,7 +20,7 @@
 using namespace Lisa;
 
 Lexer::Lexer():
-    d_lastToken(Tok_Invalid),d_lineNr(0),d_colNr(0),d_in(0),
+    d_lastToken(Tok_Invalid),d_lineNr(0),d_colNr(0),d_in(0),d_lineOff(0),d_tokOff(0),
     d_ignoreComments(true), d_packComments(true),d_sloc(0),d_lineCounted(false)
 {
 
@@ -35,12 +35,34 @@ void Lexer::setStream(QIODevice* in, const QString& filePath)
     d_in = in;
     d_lineNr = 0;
     d_colNr = 0;
+    d_lineOff = 0;
+    d_tokOff = 0;
     d_lastToken = Tok_Invalid;
     d_filePath = filePath;
     d_sloc = 0;
     d_lineCounted = false;
 }
 
+bool Lexer::setPos(quint32 line, quint16 col)
+{
+    // rewind and continue scanning at line/col (col is zero based); lines before are not counted as sloc
+    if( d_in == 0 || !d_in->reset() )
+        return false;
+    d_buffer.clear();
+    d_line.clear();
+    d_lineNr = 0;
+    d_colNr = 0;
+    d_lineOff = 0;
+    while( d_lineNr < line && !d_in->atEnd() )
+        nextLine();
+    if( d_lineNr != line )
+        return false;
+    d_colNr = col;
+    d_lastToken = Tok_Invalid;
+    d_lineCounted = true;
+    return true;
+}
+
 Token Lexer::nextToken()
 {
     Token t;
@@ -148,6 +170,7 @@ void Lexer::nextLine()
 {
     d_colNr = 0;
     d_lineNr++;
+    d_lineOff = d_in->pos();
     d_line = d_in->readLine();
     d_lineCounted = false;
 
@@ -172,12 +195,11 @@ Token Lexer::token(TokenType tt, int len, const QByteArray& val)
         countLine();
     Token t( tt, d_lineNr, d_colNr + 1, val );
     d_lastToken = t;
+    d_tokOff = d_lineOff + d_colNr;
     d_colNr += len;
     t.d_len = len;
-#if 0
     if( tt == Tok_identifier )
         t.d_id = Token::toId(val);
-#endif
     t.d_sourcePath = d_filePath;
     return t;
 }
@@ -298,6 +320,7 @@ Token Lexer::comment(bool brace)
     const int startLine = d_lineNr;
     const int startCol = d_colNr;
     // startLine and startCol point to first char of (* or {
+    d_tokOff = d_lineOff + d_colNr;
 
     const QByteArray tag = brace ? "}" : "*)";
     int pos = d_line.indexOf(tag,d_colNr);
@@ -39,6 +39,12 @@ public:
     Token peekToken(quint8 lookAhead = 1);
     QList<Token> tokens( const QString& code );
     quint32 getSloc() const { return d_sloc; }
+    quint32 getLineNr() const { return d_lineNr; }
+    quint16 getColNr() const { return d_colNr; }
+    const QString& getFilePath() const { return d_filePath; }
+    bool setPos( quint32 line, quint16 col );
+    quint32 getOffset() const { return d_lineOff + d_colNr; } // byte offset of the current position
+    quint32 getTokenOffset() const { return d_tokOff; } // byte offset of the last token delivered
 protected:
     Token nextTokenImp();
     int skipWhiteSpace();
@@ -56,6 +62,8 @@ private:
     quint32 d_lineNr;
     quint16 d_colNr;
     QByteArray d_line;
+    quint32 d_lineOff; // byte offset of d_line in d_in
+    quint32 d_tokOff;
     QList<Token> d_buffer;
     Token d_lastToken;
     quint32 d_sloc; // number of lines of code without empty or comment lines
@@ -30,6 +30,95 @@ void Parser::RunParser()
     d_stack.pop();
 }
     
+bool Parser::deferStatementPart()
+{
+	if( !d_deferBodies || d_next.d_type != Lisa::Tok_begin || d_stack.size() < 2 )
+		return false;
+	// only bodies of procedures, functions and methods; the main program is always parsed
+	const int outer = d_stack[d_stack.size()-2]->d_tok.d_type;
+	if( outer != Lisa::SynTree::R_body_ && outer != Lisa::SynTree::R_method_block )
+		return false;
+	Deferred d;
+	if( !scanner->saveState(d.d_state, d_next) )
+		return false;
+	d.d_node = d_stack.top();
+	int level = 0;
+	while( d_next.d_type != _EOF )
+	{
+		if( d_next.d_type == Lisa::Tok_begin || d_next.d_type == Lisa::Tok_case )
+			level++;
+		else if( d_next.d_type == Lisa::Tok_end )
+			level--;
+		Get();
+		if( level == 0 )
+			break;
+	}
+	d_deferred.append(d);
+	return true;
+}
+
+void Parser::RunStatementPart(Lisa::SynTree* st)
+{
+	d_stack.push(st);
+	d_cur = Token();
+	d_next = Token();
+	Get();
+	compound_statement();
+	d_stack.pop();
+}
+
+static inline int binaryPrecedence(int t)
+{
+	switch( t )
+	{
+	case Lisa::Tok_Plus:
+	case Lisa::Tok_Minus:
+	case Lisa::Tok_or:
+		return Parser::PrecAdd;
+	case Lisa::Tok_Star:
+	case Lisa::Tok_Slash:
+	case Lisa::Tok_Colon:
+	case Lisa::Tok_div:
+	case Lisa::Tok_mod:
+	case Lisa::Tok_and:
+		return Parser::PrecMul;
+	default:
+		return 0;
+	}
+}
+
+Lisa::SynTree* Parser::binaryExpression(int minPrec)
+{
+	Lisa::SynTree* lhs;
+	if( minPrec <= PrecAdd && ( d_next.d_type == Lisa::Tok_Plus || d_next.d_type == Lisa::Tok_Minus ) )
+	{
+		// a sign applies to the first term of a simple_expression
+		lhs = new Lisa::SynTree( Lisa::SynTree::R_sign, d_next );
+		Get();
+		lhs->d_children.append( new Lisa::SynTree( d_cur ) );
+		lhs->d_children.append( binaryExpression(PrecMul) );
+	}else
+	{
+		d_stack.push(&d_operands);
+		factor();
+		d_stack.pop();
+		lhs = d_operands.d_children.takeLast(); // factors nested in parens also pass here
+	}
+	int prec = binaryPrecedence(d_next.d_type);
+	while( prec != 0 && prec >= minPrec )
+	{
+		Lisa::SynTree* n = new Lisa::SynTree( prec == PrecAdd ? Lisa::SynTree::R_simple_expression :
+											  Lisa::SynTree::R_term, lhs->d_tok );
+		Get();
+		n->d_children.append( lhs );
+		n->d_children.append( new Lisa::SynTree( d_cur ) );
+		n->d_children.append( binaryExpression(prec + 1) ); // left associative
+		lhs = n;
+		prec = binaryPrecedence(d_next.d_type);
+	}
+	return lhs;
+}
+
 void Parser::SynErr(int n, const char* ctx) {
     if (errDist >= minErrDist)
        SynErr(d_next.d_lineNr, d_next.d_colNr, n, ctx, QString(), d_next.d_sourcePath);
@@ -55,7 +144,7 @@ void Parser::Get() {
             // else errors already handeled in lexer
             break;
         case Lisa::Tok_Comment:
-            d_comments.append(d_next);
+            // comments are recorded by PpLexer if requested
             break;
         default:
             deliverToParser = true;
@@ -67,8 +156,7 @@ void Parser::Get() {
             if( d_next.d_type == Lisa::Tok_Eof )
                 d_next.d_type = _EOF;
 
-            la->kind = d_next.d_type;
-            if (la->kind <= maxT)
+            if (d_next.d_type <= maxT)
             {
                 ++errDist;
                 break;
@@ -80,11 +168,11 @@ void Parser::Get() {
 }
 
 void Parser::Expect(int n, const char* ctx ) {
-	if (la->kind==n) Get(); else { SynErr(n, ctx); }
+	if (d_next.d_type==n) Get(); else { SynErr(n, ctx); }
 }
 
 void Parser::ExpectWeak(int n, int follow) {
-	if (la->kind == n) Get();
+	if (d_next.d_type == n) Get();
 	else {
 		SynErr(n);
 		while (!StartOf(follow)) Get();
@@ -92,7 +180,7 @@ void Parser::ExpectWeak(int n, int follow) {
 }
 
 bool Parser::WeakSeparator(int n, int syFol, int repFol) {
-	if (la->kind == n) {Get(); return true;}
+	if (d_next.d_type == n) {Get(); return true;}
 	else if (StartOf(repFol)) {return false;}
 	else {
 		SynErr(n);
@@ -105,9 +193,9 @@ bool Parser::WeakSeparator(int n, int syFol, int repFol) {
 
 void Parser::LisaPascal() {
 		d_stack.push(&d_root); 
-		if (la->kind == _T_program) {
+		if (d_next.d_type == _T_program) {
 			program_();
-		} else if (la->kind == _T_unit) {
+		} else if (d_next.d_type == _T_unit) {
 			regular_unit();
 		} else if (StartOf(1)) {
 			non_regular_unit();
@@ -120,11 +208,11 @@ void Parser::program_() {
 		program_heading();
 		Expect(_T_Semi,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_uses) {
+		if (d_next.d_type == _T_uses) {
 			uses_clause();
 		}
 		block();
-		if (la->kind == _T_begin) {
+		if (d_next.d_type == _T_begin) {
 			statement_part();
 			Expect(_T_Dot,__FUNCTION__);
 			addTerminal(); 
@@ -137,10 +225,10 @@ void Parser::regular_unit() {
 		unit_heading();
 		Expect(_T_Semi,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_intrinsic) {
+		if (d_next.d_type == _T_intrinsic) {
 			Get();
 			addTerminal(); 
-			if (la->kind == _T_shared) {
+			if (d_next.d_type == _T_shared) {
 				Get();
 				addTerminal(); 
 			}
@@ -149,7 +237,7 @@ void Parser::regular_unit() {
 		}
 		interface_part();
 		implementation_part();
-		if (la->kind == _T_end) {
+		if (d_next.d_type == _T_end) {
 			Get();
 			addTerminal(); 
 			Expect(_T_Dot,__FUNCTION__);
@@ -163,8 +251,8 @@ void Parser::non_regular_unit() {
 		while (( peek(1) == _T_procedure || peek(1) == _T_function ) ) {
 			procedure_and_function_declaration_part();
 		}
-		if (la->kind == _T_begin || la->kind == _T_end) {
-			if (la->kind == _T_begin) {
+		if (d_next.d_type == _T_begin || d_next.d_type == _T_end) {
+			if (d_next.d_type == _T_begin) {
 				statement_part();
 				Expect(_T_Dot,__FUNCTION__);
 				addTerminal(); 
@@ -184,7 +272,7 @@ void Parser::program_heading() {
 		addTerminal(); 
 		Expect(_T_identifier,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_Lpar) {
+		if (d_next.d_type == _T_Lpar) {
 			Get();
 			addTerminal(); 
 			program_parameters();
@@ -207,13 +295,13 @@ void Parser::uses_clause() {
 void Parser::block() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_block, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		while (StartOf(2)) {
-			if (la->kind == _T_label) {
+			if (d_next.d_type == _T_label) {
 				label_declaration_part();
-			} else if (la->kind == _T_const) {
+			} else if (d_next.d_type == _T_const) {
 				constant_declaration_part();
-			} else if (la->kind == _T_type) {
+			} else if (d_next.d_type == _T_type) {
 				type_declaration_part();
-			} else if (la->kind == _T_var) {
+			} else if (d_next.d_type == _T_var) {
 				variable_declaration_part();
 			} else {
 				procedure_and_function_declaration_part();
@@ -224,6 +312,7 @@ void Parser::block() {
 
 void Parser::statement_part() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_statement_part, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
+		if( deferStatementPart() ) { d_stack.pop(); return; } 
 		compound_statement();
 		d_stack.pop(); 
 }
@@ -238,7 +327,7 @@ void Parser::identifier_list() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_identifier_list, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		Expect(_T_identifier,__FUNCTION__);
 		addTerminal(); 
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			Expect(_T_identifier,__FUNCTION__);
@@ -251,18 +340,18 @@ void Parser::identifier_list2() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_identifier_list2, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		Expect(_T_identifier,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_Slash) {
+		if (d_next.d_type == _T_Slash) {
 			Get();
 			addTerminal(); 
 			Expect(_T_identifier,__FUNCTION__);
 			addTerminal(); 
 		}
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			Expect(_T_identifier,__FUNCTION__);
 			addTerminal(); 
-			if (la->kind == _T_Slash) {
+			if (d_next.d_type == _T_Slash) {
 				Get();
 				addTerminal(); 
 				Expect(_T_identifier,__FUNCTION__);
@@ -285,15 +374,15 @@ void Parser::interface_part() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_interface_part, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		Expect(_T_interface,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_uses) {
+		if (d_next.d_type == _T_uses) {
 			uses_clause();
 		}
 		while (StartOf(3)) {
-			if (la->kind == _T_const) {
+			if (d_next.d_type == _T_const) {
 				constant_declaration_part();
-			} else if (la->kind == _T_type) {
+			} else if (d_next.d_type == _T_type) {
 				type_declaration_part();
-			} else if (la->kind == _T_var) {
+			} else if (d_next.d_type == _T_var) {
 				variable_declaration_part();
 			} else {
 				procedure_and_function_interface_part();
@@ -307,11 +396,11 @@ void Parser::implementation_part() {
 		Expect(_T_implementation,__FUNCTION__);
 		addTerminal(); 
 		while (StartOf(4)) {
-			if (la->kind == _T_const) {
+			if (d_next.d_type == _T_const) {
 				constant_declaration_part();
-			} else if (la->kind == _T_type) {
+			} else if (d_next.d_type == _T_type) {
 				type_declaration_part();
-			} else if (la->kind == _T_var) {
+			} else if (d_next.d_type == _T_var) {
 				variable_declaration_part();
 			} else {
 				subroutine_part();
@@ -325,7 +414,7 @@ void Parser::constant_declaration_part() {
 		Expect(_T_const,__FUNCTION__);
 		addTerminal(); 
 		constant_declaration();
-		while (la->kind == _T_identifier) {
+		while (d_next.d_type == _T_identifier) {
 			constant_declaration();
 		}
 		d_stack.pop(); 
@@ -336,7 +425,7 @@ void Parser::type_declaration_part() {
 		Expect(_T_type,__FUNCTION__);
 		addTerminal(); 
 		type_declaration();
-		while (la->kind == _T_identifier) {
+		while (d_next.d_type == _T_identifier) {
 			type_declaration();
 		}
 		d_stack.pop(); 
@@ -347,7 +436,7 @@ void Parser::variable_declaration_part() {
 		Expect(_T_var,__FUNCTION__);
 		addTerminal(); 
 		variable_declaration();
-		while (la->kind == _T_identifier) {
+		while (d_next.d_type == _T_identifier) {
 			variable_declaration();
 		}
 		d_stack.pop(); 
@@ -355,8 +444,8 @@ void Parser::variable_declaration_part() {
 
 void Parser::procedure_and_function_interface_part() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_procedure_and_function_interface_part, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		while (la->kind == _T_function || la->kind == _T_procedure) {
-			if (la->kind == _T_procedure) {
+		while (d_next.d_type == _T_function || d_next.d_type == _T_procedure) {
+			if (d_next.d_type == _T_procedure) {
 				procedure_heading();
 				Expect(_T_Semi,__FUNCTION__);
 				addTerminal(); 
@@ -371,10 +460,10 @@ void Parser::procedure_and_function_interface_part() {
 
 void Parser::subroutine_part() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_subroutine_part, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		while (la->kind == _T_function || la->kind == _T_methods || la->kind == _T_procedure) {
-			if (la->kind == _T_procedure) {
+		while (d_next.d_type == _T_function || d_next.d_type == _T_methods || d_next.d_type == _T_procedure) {
+			if (d_next.d_type == _T_procedure) {
 				procedure_declaration();
-			} else if (la->kind == _T_function) {
+			} else if (d_next.d_type == _T_function) {
 				function_declaration();
 			} else {
 				method_block();
@@ -385,8 +474,8 @@ void Parser::subroutine_part() {
 
 void Parser::procedure_and_function_declaration_part() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_procedure_and_function_declaration_part, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		while (la->kind == _T_function || la->kind == _T_procedure) {
-			if (la->kind == _T_procedure) {
+		while (d_next.d_type == _T_function || d_next.d_type == _T_procedure) {
+			if (d_next.d_type == _T_procedure) {
 				procedure_declaration();
 			} else {
 				function_declaration();
@@ -400,7 +489,7 @@ void Parser::label_declaration_part() {
 		Expect(_T_label,__FUNCTION__);
 		addTerminal(); 
 		label_();
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			label_();
@@ -424,7 +513,7 @@ void Parser::constant_declaration() {
 		Expect(_T_Eq,__FUNCTION__);
 		addTerminal(); 
 		expression();
-		if (la->kind == _T_Semi) {
+		if (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 		}
@@ -433,10 +522,11 @@ void Parser::constant_declaration() {
 
 void Parser::expression() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_expression, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		simple_expression();
+		n->d_children.append( binaryExpression(PrecAdd) ); 
 		if (StartOf(5)) {
-			relational_operator();
-			simple_expression();
+			Get();
+			addTerminal(); 
+			n->d_children.append( binaryExpression(PrecAdd) ); 
 		}
 		d_stack.pop(); 
 }
@@ -444,19 +534,19 @@ void Parser::expression() {
 void Parser::constant() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_constant, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		if (StartOf(6)) {
-			if (la->kind == _T_Plus || la->kind == _T_Minus) {
+			if (d_next.d_type == _T_Plus || d_next.d_type == _T_Minus) {
 				sign();
 			}
-			if (la->kind == _T_identifier) {
+			if (d_next.d_type == _T_identifier) {
 				Get();
 				addTerminal(); 
-				if (la->kind == _T_Lpar) {
+				if (d_next.d_type == _T_Lpar) {
 					actual_parameter_list();
 				}
-			} else if (la->kind == _T_unsigned_real || la->kind == _T_digit_sequence || la->kind == _T_hex_digit_sequence) {
+			} else if (d_next.d_type == _T_unsigned_real || d_next.d_type == _T_digit_sequence || d_next.d_type == _T_hex_digit_sequence) {
 				unsigned_number();
 			} else SynErr(89,__FUNCTION__);
-		} else if (la->kind == _T_string_literal) {
+		} else if (d_next.d_type == _T_string_literal) {
 			Get();
 			addTerminal(); 
 		} else SynErr(90,__FUNCTION__);
@@ -465,10 +555,10 @@ void Parser::constant() {
 
 void Parser::sign() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_sign, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_Plus) {
+		if (d_next.d_type == _T_Plus) {
 			Get();
 			addTerminal(); 
-		} else if (la->kind == _T_Minus) {
+		} else if (d_next.d_type == _T_Minus) {
 			Get();
 			addTerminal(); 
 		} else SynErr(91,__FUNCTION__);
@@ -480,7 +570,7 @@ void Parser::actual_parameter_list() {
 		Expect(_T_Lpar,__FUNCTION__);
 		addTerminal(); 
 		actual_parameter();
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			actual_parameter();
@@ -492,9 +582,9 @@ void Parser::actual_parameter_list() {
 
 void Parser::unsigned_number() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_unsigned_number, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_digit_sequence || la->kind == _T_hex_digit_sequence) {
+		if (d_next.d_type == _T_digit_sequence || d_next.d_type == _T_hex_digit_sequence) {
 			unsigned_integer();
-		} else if (la->kind == _T_unsigned_real) {
+		} else if (d_next.d_type == _T_unsigned_real) {
 			Get();
 			addTerminal(); 
 		} else SynErr(92,__FUNCTION__);
@@ -517,11 +607,11 @@ void Parser::type_() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_type_, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		if (StartOf(7)) {
 			simple_type();
-		} else if (la->kind == _T_string) {
+		} else if (d_next.d_type == _T_string) {
 			string_type();
 		} else if (StartOf(8)) {
 			structured_type();
-		} else if (la->kind == _T_Hat) {
+		} else if (d_next.d_type == _T_Hat) {
 			pointer_type();
 		} else SynErr(93,__FUNCTION__);
 		d_stack.pop(); 
@@ -544,13 +634,13 @@ void Parser::procedure_heading() {
 		addTerminal(); 
 		Expect(_T_identifier,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_Dot) {
+		if (d_next.d_type == _T_Dot) {
 			Get();
 			addTerminal(); 
 			Expect(_T_identifier,__FUNCTION__);
 			addTerminal(); 
 		}
-		if (la->kind == _T_Lpar) {
+		if (d_next.d_type == _T_Lpar) {
 			formal_parameter_list();
 		}
 		d_stack.pop(); 
@@ -562,16 +652,16 @@ void Parser::function_heading() {
 		addTerminal(); 
 		Expect(_T_identifier,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_Dot) {
+		if (d_next.d_type == _T_Dot) {
 			Get();
 			addTerminal(); 
 			Expect(_T_identifier,__FUNCTION__);
 			addTerminal(); 
 		}
-		if (la->kind == _T_Lpar) {
+		if (d_next.d_type == _T_Lpar) {
 			formal_parameter_list();
 		}
-		if (la->kind == _T_Colon) {
+		if (d_next.d_type == _T_Colon) {
 			Get();
 			addTerminal(); 
 			result_type();
@@ -609,20 +699,20 @@ void Parser::method_block() {
 		addTerminal(); 
 		Expect(_T_identifier,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_Semi) {
+		if (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 		}
 		if (StartOf(9)) {
 			procedure_and_function_declaration_part();
 		}
-		if (la->kind == _T_begin) {
+		if (d_next.d_type == _T_begin) {
 			statement_part();
-		} else if (la->kind == _T_end) {
+		} else if (d_next.d_type == _T_end) {
 			Get();
 			addTerminal(); 
 		} else SynErr(94,__FUNCTION__);
-		if (la->kind == _T_Semi) {
+		if (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 		}
@@ -634,13 +724,13 @@ void Parser::body_() {
 		if (StartOf(10)) {
 			block();
 			statement_part();
-		} else if (la->kind == _T_forward) {
+		} else if (d_next.d_type == _T_forward) {
 			Get();
 			addTerminal(); 
-		} else if (la->kind == _T_external) {
+		} else if (d_next.d_type == _T_external) {
 			Get();
 			addTerminal(); 
-		} else if (la->kind == _T_inline) {
+		} else if (d_next.d_type == _T_inline) {
 			Get();
 			addTerminal(); 
 			constant();
@@ -664,7 +754,7 @@ void Parser::formal_parameter_list() {
 		addTerminal(); 
 		formal_parameter_section();
 		while (StartOf(11)) {
-			if (la->kind == _T_Semi) {
+			if (d_next.d_type == _T_Semi) {
 				Get();
 				addTerminal(); 
 			}
@@ -690,11 +780,11 @@ void Parser::type_identifier() {
 
 void Parser::formal_parameter_section() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_formal_parameter_section, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_var || la->kind == _T_identifier) {
+		if (d_next.d_type == _T_var || d_next.d_type == _T_identifier) {
 			parameter_declaration();
-		} else if (la->kind == _T_procedure) {
+		} else if (d_next.d_type == _T_procedure) {
 			procedure_heading();
-		} else if (la->kind == _T_function) {
+		} else if (d_next.d_type == _T_function) {
 			function_heading();
 		} else SynErr(96,__FUNCTION__);
 		d_stack.pop(); 
@@ -702,7 +792,7 @@ void Parser::formal_parameter_section() {
 
 void Parser::parameter_declaration() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_parameter_declaration, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_var) {
+		if (d_next.d_type == _T_var) {
 			Get();
 			addTerminal(); 
 		}
@@ -716,7 +806,7 @@ void Parser::parameter_declaration() {
 void Parser::statement_sequence() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_statement_sequence, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		statement();
-		while (la->kind == _T_Semi) {
+		while (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 			statement();
@@ -726,13 +816,13 @@ void Parser::statement_sequence() {
 
 void Parser::statement() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_statement, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_digit_sequence) {
+		if (d_next.d_type == _T_digit_sequence) {
 			label_();
 			Expect(_T_Colon,__FUNCTION__);
 			addTerminal(); 
 		}
 		if (StartOf(12)) {
-			if (la->kind == _T_goto || la->kind == _T_identifier) {
+			if (d_next.d_type == _T_goto || d_next.d_type == _T_identifier) {
 				simple_statement();
 			}
 		} else if (StartOf(13)) {
@@ -743,9 +833,9 @@ void Parser::statement() {
 
 void Parser::simple_statement() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_simple_statement, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_identifier) {
+		if (d_next.d_type == _T_identifier) {
 			assigOrCall();
-		} else if (la->kind == _T_goto) {
+		} else if (d_next.d_type == _T_goto) {
 			goto_statement();
 		} else SynErr(98,__FUNCTION__);
 		d_stack.pop(); 
@@ -753,13 +843,13 @@ void Parser::simple_statement() {
 
 void Parser::structured_statement() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_structured_statement, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_begin) {
+		if (d_next.d_type == _T_begin) {
 			compound_statement();
-		} else if (la->kind == _T_for || la->kind == _T_repeat || la->kind == _T_while) {
+		} else if (d_next.d_type == _T_for || d_next.d_type == _T_repeat || d_next.d_type == _T_while) {
 			repetitive_statement();
-		} else if (la->kind == _T_case || la->kind == _T_if) {
+		} else if (d_next.d_type == _T_case || d_next.d_type == _T_if) {
 			conditional_statement();
-		} else if (la->kind == _T_with) {
+		} else if (d_next.d_type == _T_with) {
 			with_statement();
 		} else SynErr(99,__FUNCTION__);
 		d_stack.pop(); 
@@ -768,7 +858,7 @@ void Parser::structured_statement() {
 void Parser::assigOrCall() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_assigOrCall, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		variable_reference();
-		if (la->kind == _T_ColonEq) {
+		if (d_next.d_type == _T_ColonEq) {
 			Get();
 			addTerminal(); 
 			expression();
@@ -788,7 +878,7 @@ void Parser::variable_reference() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_variable_reference, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		variable_identifier();
 		while (StartOf(14)) {
-			if (la->kind == _T_Dot || la->kind == _T_Lbrack || la->kind == _T_Hat) {
+			if (d_next.d_type == _T_Dot || d_next.d_type == _T_Lbrack || d_next.d_type == _T_Hat) {
 				qualifier();
 			} else {
 				actual_parameter_list();
@@ -799,11 +889,11 @@ void Parser::variable_reference() {
 
 void Parser::repetitive_statement() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_repetitive_statement, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_while) {
+		if (d_next.d_type == _T_while) {
 			while_statement();
-		} else if (la->kind == _T_repeat) {
+		} else if (d_next.d_type == _T_repeat) {
 			repeat_statement();
-		} else if (la->kind == _T_for) {
+		} else if (d_next.d_type == _T_for) {
 			for_statement();
 		} else SynErr(100,__FUNCTION__);
 		d_stack.pop(); 
@@ -811,9 +901,9 @@ void Parser::repetitive_statement() {
 
 void Parser::conditional_statement() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_conditional_statement, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_if) {
+		if (d_next.d_type == _T_if) {
 			if_statement();
-		} else if (la->kind == _T_case) {
+		} else if (d_next.d_type == _T_case) {
 			case_statement();
 		} else SynErr(101,__FUNCTION__);
 		d_stack.pop(); 
@@ -824,7 +914,7 @@ void Parser::with_statement() {
 		Expect(_T_with,__FUNCTION__);
 		addTerminal(); 
 		variable_reference();
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			variable_reference();
@@ -865,10 +955,10 @@ void Parser::for_statement() {
 		Expect(_T_ColonEq,__FUNCTION__);
 		addTerminal(); 
 		initial_value();
-		if (la->kind == _T_to) {
+		if (d_next.d_type == _T_to) {
 			Get();
 			addTerminal(); 
-		} else if (la->kind == _T_downto) {
+		} else if (d_next.d_type == _T_downto) {
 			Get();
 			addTerminal(); 
 		} else SynErr(102,__FUNCTION__);
@@ -906,7 +996,7 @@ void Parser::if_statement() {
 		Expect(_T_then,__FUNCTION__);
 		addTerminal(); 
 		statement();
-		if (la->kind == _T_else) {
+		if (d_next.d_type == _T_else) {
 			Get();
 			addTerminal(); 
 			statement();
@@ -934,7 +1024,7 @@ void Parser::case_statement() {
 		if (( peek(1) == _T_otherwise || peek(1) == _T_Semi ) && ( peek(2) == _T_begin || peek(2) == _T_case || peek(2) == _T_digit_sequence || peek(2) == _T_for || peek(2) == _T_goto || peek(2) == _T_identifier || peek(2) == _T_if || peek(2) == _T_otherwise || peek(2) == _T_repeat || peek(2) == _T_while || peek(2) == _T_with ) ) {
 			otherwise_clause();
 		}
-		if (la->kind == _T_Semi) {
+		if (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 		}
@@ -954,7 +1044,7 @@ void Parser::case_limb() {
 
 void Parser::otherwise_clause() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_otherwise_clause, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_Semi) {
+		if (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 		}
@@ -967,7 +1057,7 @@ void Parser::otherwise_clause() {
 void Parser::case_label_list() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_case_label_list, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		constant();
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			constant();
@@ -981,90 +1071,9 @@ void Parser::actual_parameter() {
 		d_stack.pop(); 
 }
 
-void Parser::simple_expression() {
-		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_simple_expression, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_Plus || la->kind == _T_Minus) {
-			sign();
-		}
-		term();
-		while (la->kind == _T_Plus || la->kind == _T_Minus || la->kind == _T_or) {
-			addition_operator();
-			term();
-		}
-		d_stack.pop(); 
-}
-
-void Parser::relational_operator() {
-		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_relational_operator, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		switch (la->kind) {
-		case _T_Eq: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_LtGt: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_Lt: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_Leq: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_Gt: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_Geq: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_in: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		default: SynErr(103,__FUNCTION__); break;
-		}
-		d_stack.pop(); 
-}
-
-void Parser::term() {
-		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_term, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		factor();
-		while (StartOf(16)) {
-			multiplication_operator();
-			factor();
-		}
-		d_stack.pop(); 
-}
-
-void Parser::addition_operator() {
-		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_addition_operator, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_Plus) {
-			Get();
-			addTerminal(); 
-		} else if (la->kind == _T_Minus) {
-			Get();
-			addTerminal(); 
-		} else if (la->kind == _T_or) {
-			Get();
-			addTerminal(); 
-		} else SynErr(104,__FUNCTION__);
-		d_stack.pop(); 
-}
-
 void Parser::factor() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_factor, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		switch (la->kind) {
+		switch (d_next.d_type) {
 		case _T_At: {
 			Get();
 			addTerminal(); 
@@ -1075,7 +1084,7 @@ void Parser::factor() {
 			Get();
 			addTerminal(); 
 			while (StartOf(14)) {
-				if (la->kind == _T_Dot || la->kind == _T_Lbrack || la->kind == _T_Hat) {
+				if (d_next.d_type == _T_Dot || d_next.d_type == _T_Lbrack || d_next.d_type == _T_Hat) {
 					qualifier();
 				} else {
 					actual_parameter_list();
@@ -1120,51 +1129,13 @@ void Parser::factor() {
 		d_stack.pop(); 
 }
 
-void Parser::multiplication_operator() {
-		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_multiplication_operator, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		switch (la->kind) {
-		case _T_Star: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_Slash: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_Colon: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_div: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_mod: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		case _T_and: {
-			Get();
-			addTerminal(); 
-			break;
-		}
-		default: SynErr(106,__FUNCTION__); break;
-		}
-		d_stack.pop(); 
-}
-
 void Parser::qualifier() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_qualifier, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_Lbrack) {
+		if (d_next.d_type == _T_Lbrack) {
 			index();
-		} else if (la->kind == _T_Dot) {
+		} else if (d_next.d_type == _T_Dot) {
 			field_designator();
-		} else if (la->kind == _T_Hat) {
+		} else if (d_next.d_type == _T_Hat) {
 			dereferencer();
 		} else SynErr(107,__FUNCTION__);
 		d_stack.pop(); 
@@ -1176,7 +1147,7 @@ void Parser::set_literal() {
 		addTerminal(); 
 		if (StartOf(17)) {
 			member_group();
-			while (la->kind == _T_Comma) {
+			while (d_next.d_type == _T_Comma) {
 				Get();
 				addTerminal(); 
 				member_group();
@@ -1215,7 +1186,7 @@ void Parser::dereferencer() {
 void Parser::expression_list() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_expression_list, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		expression();
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			expression();
@@ -1233,7 +1204,7 @@ void Parser::field_identifier() {
 void Parser::member_group() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_member_group, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		expression();
-		if (la->kind == _T_2Dot) {
+		if (d_next.d_type == _T_2Dot) {
 			Get();
 			addTerminal(); 
 			expression();
@@ -1248,7 +1219,7 @@ void Parser::simple_type() {
 			addTerminal(); 
 		} else if (StartOf(15)) {
 			subrange_type();
-		} else if (la->kind == _T_Lpar) {
+		} else if (d_next.d_type == _T_Lpar) {
 			enumerated_type();
 		} else SynErr(108,__FUNCTION__);
 		d_stack.pop(); 
@@ -1268,19 +1239,19 @@ void Parser::string_type() {
 
 void Parser::structured_type() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_structured_type, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_packed) {
+		if (d_next.d_type == _T_packed) {
 			Get();
 			addTerminal(); 
 		}
-		if (la->kind == _T_array) {
+		if (d_next.d_type == _T_array) {
 			array_type();
-		} else if (la->kind == _T_record) {
+		} else if (d_next.d_type == _T_record) {
 			record_type();
-		} else if (la->kind == _T_set) {
+		} else if (d_next.d_type == _T_set) {
 			set_type();
-		} else if (la->kind == _T_file) {
+		} else if (d_next.d_type == _T_file) {
 			file_type();
-		} else if (la->kind == _T_subclass) {
+		} else if (d_next.d_type == _T_subclass) {
 			class_type();
 		} else SynErr(109,__FUNCTION__);
 		d_stack.pop(); 
@@ -1297,10 +1268,10 @@ void Parser::pointer_type() {
 void Parser::subrange_type() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_subrange_type, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		constant();
-		if (la->kind == _T_2Dot) {
+		if (d_next.d_type == _T_2Dot) {
 			Get();
 			addTerminal(); 
-		} else if (la->kind == _T_Colon) {
+		} else if (d_next.d_type == _T_Colon) {
 			Get();
 			addTerminal(); 
 		} else SynErr(110,__FUNCTION__);
@@ -1326,9 +1297,9 @@ void Parser::ordinal_type() {
 
 void Parser::size_attribute() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_size_attribute, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_digit_sequence || la->kind == _T_hex_digit_sequence) {
+		if (d_next.d_type == _T_digit_sequence || d_next.d_type == _T_hex_digit_sequence) {
 			unsigned_integer();
-		} else if (la->kind == _T_identifier) {
+		} else if (d_next.d_type == _T_identifier) {
 			Get();
 			addTerminal(); 
 		} else SynErr(111,__FUNCTION__);
@@ -1337,10 +1308,10 @@ void Parser::size_attribute() {
 
 void Parser::unsigned_integer() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_unsigned_integer, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_digit_sequence) {
+		if (d_next.d_type == _T_digit_sequence) {
 			Get();
 			addTerminal(); 
-		} else if (la->kind == _T_hex_digit_sequence) {
+		} else if (d_next.d_type == _T_hex_digit_sequence) {
 			Get();
 			addTerminal(); 
 		} else SynErr(112,__FUNCTION__);
@@ -1354,7 +1325,7 @@ void Parser::array_type() {
 		Expect(_T_Lbrack,__FUNCTION__);
 		addTerminal(); 
 		index_type();
-		while (la->kind == _T_Comma) {
+		while (d_next.d_type == _T_Comma) {
 			Get();
 			addTerminal(); 
 			index_type();
@@ -1371,7 +1342,7 @@ void Parser::record_type() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_record_type, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		Expect(_T_record,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_case || la->kind == _T_identifier) {
+		if (d_next.d_type == _T_case || d_next.d_type == _T_identifier) {
 			field_list();
 		}
 		Expect(_T_end,__FUNCTION__);
@@ -1393,7 +1364,7 @@ void Parser::file_type() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_file_type, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
 		Expect(_T_file,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_of) {
+		if (d_next.d_type == _T_of) {
 			Get();
 			addTerminal(); 
 			type_();
@@ -1407,17 +1378,17 @@ void Parser::class_type() {
 		addTerminal(); 
 		Expect(_T_of,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_identifier) {
+		if (d_next.d_type == _T_identifier) {
 			type_identifier();
-		} else if (la->kind == _T_nil) {
+		} else if (d_next.d_type == _T_nil) {
 			Get();
 			addTerminal(); 
 		} else SynErr(113,__FUNCTION__);
-		if (la->kind == _T_case || la->kind == _T_identifier) {
+		if (d_next.d_type == _T_case || d_next.d_type == _T_identifier) {
 			field_list();
 		}
 		method_interface();
-		while (la->kind == _T_function || la->kind == _T_procedure) {
+		while (d_next.d_type == _T_function || d_next.d_type == _T_procedure) {
 			method_interface();
 		}
 		Expect(_T_end,__FUNCTION__);
@@ -1433,17 +1404,17 @@ void Parser::index_type() {
 
 void Parser::field_list() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_field_list, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_identifier) {
+		if (d_next.d_type == _T_identifier) {
 			fixed_part();
 			if (peek(1) == _T_Semi && peek(2) == _T_case ) {
 				Expect(_T_Semi,__FUNCTION__);
 				addTerminal(); 
 				variant_part();
 			}
-		} else if (la->kind == _T_case) {
+		} else if (d_next.d_type == _T_case) {
 			variant_part();
 		} else SynErr(114,__FUNCTION__);
-		if (la->kind == _T_Semi) {
+		if (d_next.d_type == _T_Semi) {
 			Get();
 			addTerminal(); 
 		}
@@ -1452,9 +1423,9 @@ void Parser::field_list() {
 
 void Parser::method_interface() {
 		Lisa::SynTree* n = new Lisa::SynTree( Lisa::SynTree::R_method_interface, d_next ); d_stack.top()->d_children.append(n); d_stack.push(n); 
-		if (la->kind == _T_procedure) {
+		if (d_next.d_type == _T_procedure) {
 			procedure_heading();
-		} else if (la->kind == _T_function) {
+		} else if (d_next.d_type == _T_function) {
 			function_heading();
 		} else SynErr(115,__FUNCTION__);
 		if (peek(1) == _T_Semi && peek(2) == _T_identifier ) {
@@ -1523,7 +1494,7 @@ void Parser::variant() {
 		addTerminal(); 
 		Expect(_T_Lpar,__FUNCTION__);
 		addTerminal(); 
-		if (la->kind == _T_case || la->kind == _T_identifier) {
+		if (d_next.d_type == _T_case || d_next.d_type == _T_identifier) {
 			field_list();
 		}
 		Expect(_T_Rpar,__FUNCTION__);
@@ -1630,17 +1601,8 @@ void Parser::Parse() {
 	Expect(0,__FUNCTION__);
 }
 
-Parser::Parser(PpLexer *scanner) {
-	maxT = 87;
-
-	ParserInitCaller<Parser>::CallInit(this);
-	la = &d_dummy;
-	minErrDist = 2;
-	errDist = minErrDist;
-	this->scanner = scanner;
-}
-
-bool Parser::StartOf(int s) {
+static const quint64* startSets() {
+	// converts the Coco/R bool table to bitsets, two 64 bit words per set
 	const bool T = true;
 	const bool x = false;
 
@@ -1667,9 +1629,32 @@ bool Parser::StartOf(int s) {
 
 
 
-	return set[s][la->kind];
+	enum { Rows = sizeof(set) / sizeof(set[0]), Cols = sizeof(set[0]) / sizeof(set[0][0]) };
+	static quint64 bits[Rows][2];
+	static_assert( Cols <= 128, "the terminals don't fit into two 64 bit words any more" );
+	for( int r = 0; r < Rows; r++ )
+	{
+		bits[r][0] = bits[r][1] = 0;
+		for( int c = 0; c < Cols; c++ )
+			if( set[r][c] )
+				bits[r][c >> 6] |= quint64(1) << ( c & 63 );
+	}
+	return &bits[0][0];
 }
 
+Parser::Parser(PpLexer *scanner) {
+	maxT = 87;
+
+	ParserInitCaller<Parser>::CallInit(this);
+	static const quint64* sets = startSets();
+	d_sets = sets;
+	d_deferBodies = false;
+	minErrDist = 2;
+	errDist = minErrDist;
+	this->scanner = scanner;
+}
+
+
 Parser::~Parser() {
 	ParserDestroyCaller<Parser>::CallDestroy(this);
 }
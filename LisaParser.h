@@ -4,8 +4,9 @@
 #if !defined(Lisa_COCO_PARSER_H__)
 #define Lisa_COCO_PARSER_H__
 
-#include <QStack>
+#include <QVector>
 #include <LisaPascal/LisaSynTree.h>
+#include <LisaPascal/PpLexer.h>
 
 
 namespace Lisa {
@@ -111,7 +112,11 @@ private:
 	void SynErr(int n, const char* ctx = 0);
 	void Get();
 	void Expect(int n, const char* ctx = 0);
-	bool StartOf(int s);
+	bool StartOf(int s) const {
+		// d_sets holds two 64 bit words per set
+		const int k = d_next.d_type;
+		return ( d_sets[ s * 2 + ( k >> 6 ) ] >> ( k & 63 ) ) & 1;
+	}
 	void ExpectWeak(int n, int follow);
 	bool WeakSeparator(int n, int syFol, int repFol);
     void SynErr(int line, int col, int n, const char* ctx, const QString&, const QString& path );
@@ -138,21 +143,54 @@ public:
 
 	Token d_cur;
 	Token d_next;
-	QList<Token> d_comments;
-	struct TokDummy
-	{
-		int kind;
-	};
-	TokDummy d_dummy;
-	TokDummy *la;			// lookahead token
+	const quint64* d_sets;
 	
 	int peek( quint8 la = 1 );
 
+	class NodeStack
+	{
+	public:
+		NodeStack():d_size(0) { d_nodes.resize(256); d_data = d_nodes.data(); }
+		void push( Lisa::SynTree* n )
+		{
+			if( d_size == d_nodes.size() )
+			{
+				d_nodes.resize( d_size * 2 );
+				d_data = d_nodes.data();
+			}
+			d_data[d_size++] = n;
+		}
+		void pop() { Q_ASSERT( d_size > 0 ); d_size--; }
+		Lisa::SynTree* top() const { return d_data[d_size-1]; }
+		Lisa::SynTree* operator[]( int i ) const { return d_data[i]; }
+		int size() const { return d_size; }
+	private:
+		QVector<Lisa::SynTree*> d_nodes;
+		Lisa::SynTree** d_data;
+		int d_size;
+	};
+
     void RunParser();
 
+	struct Deferred
+	{
+		Lisa::SynTree* d_node; // empty statement_part placeholder
+		PpLexer::State d_state;
+	};
+	QList<Deferred> d_deferred;
+	bool d_deferBodies; // skip procedure and method statement parts, to be parsed by RunStatementPart
+	bool deferStatementPart();
+	void RunStatementPart(Lisa::SynTree*);
+
+	// hand-written precedence climbing for simple_expression, term and sign; produces
+	// R_simple_expression and R_term nodes with exactly [lhs, operator, rhs] and R_sign with [sign, operand]
+	enum { PrecAdd = 1, PrecMul = 2 };
+	Lisa::SynTree d_operands; // factor() appends here, the node is taken immediately
+	Lisa::SynTree* binaryExpression(int minPrec);
+
     
 Lisa::SynTree d_root;
-	QStack<Lisa::SynTree*> d_stack;
+	NodeStack d_stack;
 	void addTerminal() {
 		if( d_cur.d_type != Lisa::Tok_Semi && d_cur.d_type != Lisa::Tok_Comma && d_cur.d_type != Lisa::Tok_Dot ){
 			Lisa::SynTree* n = new Lisa::SynTree( d_cur ); d_stack.top()->d_children.append(n);
@@ -230,12 +268,7 @@ Lisa::SynTree d_root;
 	void otherwise_clause();
 	void case_label_list();
 	void actual_parameter();
-	void simple_expression();
-	void relational_operator();
-	void term();
-	void addition_operator();
 	void factor();
-	void multiplication_operator();
 	void qualifier();
 	void set_literal();
 	void index();
@@ -15,9 +15,11 @@ SOURCES += main.cpp \
     LisaParser.cpp \
     LisaSynTree.cpp \
     LisaTokenType.cpp \
+    LisaToken.cpp \
     Converter.cpp \
     FileSystem.cpp \
-    PpLexer.cpp
+    PpLexer.cpp \
+    LisaSynTreeIo.cpp
 
 HEADERS += \
     LisaLexer.h \
@@ -27,4 +29,5 @@ HEADERS += \
     LisaTokenType.h \
     Converter.h \
     FileSystem.h \
-    PpLexer.h
+    PpLexer.h \
+    LisaSynTreeIo.h
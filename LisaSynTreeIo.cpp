@@ -0,0 +1,296 @@
+/*
+** Copyright (C) 2023 Rochus Keller (me@rochus-keller.ch)
+**
+** This file is part of the LisaPascal project.
+**
+** $QT_BEGIN_LICENSE:LGPL21$
+** GNU Lesser General Public License Usage
+** This file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 or version 3 as published by the Free
+** Software Foundation and appearing in the file LICENSE.LGPLv21 and
+** LICENSE.LGPLv3 included in the packaging of this file. Please review the
+** following information to ensure the GNU Lesser General Public License
+** requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*/
+
+#include "LisaSynTreeIo.h"
+#include <QFile>
+#include <QVector>
+#include <QtEndian>
+using namespace Lisa;
+
+static const char s_magic[] = "LPST";
+static const int s_headerLen = 20;
+static const int s_recordLen = 16;
+
+SynTreeWriter::SynTreeWriter(QIODevice* out):d_out(out)
+{
+    Q_ASSERT( out );
+}
+
+bool SynTreeWriter::write(const SynTree* root)
+{
+    d_strIds.clear();
+    d_strs.clear();
+    d_pathIds.clear();
+    d_paths.clear();
+
+    QVector<quint32> sizes;
+    const quint32 count = countNodes(root, sizes);
+    if( d_paths.size() > 0xffff )
+        return error("too many source paths"); // the records only have 16 bits for the path index
+    const qint64 start = d_out->pos();
+
+    uchar header[s_headerLen];
+    ::memcpy(header, s_magic, 4);
+    qToLittleEndian<quint32>(Version, header + 4);
+    qToLittleEndian<quint32>(count, header + 8);
+    qToLittleEndian<quint32>(0, header + 12);
+    qToLittleEndian<quint32>(0, header + 16);
+    if( d_out->write((const char*)header, s_headerLen) != s_headerLen )
+        return error("cannot write header");
+
+    quint32 index = 0;
+    if( !writeNode(root, sizes, index) )
+        return false;
+
+    const qint64 strOff = d_out->pos() - start;
+    if( !writeTable(d_strs) )
+        return false;
+    const qint64 pathOff = d_out->pos() - start;
+    if( !writeTable(d_paths) )
+        return false;
+    const qint64 end = d_out->pos();
+
+    qToLittleEndian<quint32>(strOff, header + 12);
+    qToLittleEndian<quint32>(pathOff, header + 16);
+    if( !d_out->seek(start) || d_out->write((const char*)header, s_headerLen) != s_headerLen ||
+            !d_out->seek(end) )
+        return error("cannot update header");
+    return true;
+}
+
+quint32 SynTreeWriter::countNodes(const SynTree* node, QVector<quint32>& sizes)
+{
+    // sizes is indexed in preorder like the records; also collect the paths, so their number is known up front
+    intern(d_pathIds, d_paths, node->d_tok.d_sourcePath.toUtf8());
+    const int i = sizes.size();
+    sizes.append(0);
+    quint32 n = 0;
+    foreach( SynTree* sub, node->d_children )
+        n += countNodes(sub, sizes);
+    sizes[i] = n;
+    return n + 1;
+}
+
+bool SynTreeWriter::writeNode(const SynTree* node, const QVector<quint32>& sizes, quint32& index)
+{
+    uchar rec[s_recordLen];
+    const Token& t = node->d_tok;
+    qToLittleEndian<quint16>(t.d_type, rec);
+    qToLittleEndian<quint16>(intern(d_pathIds, d_paths, t.d_sourcePath.toUtf8()), rec + 2);
+    qToLittleEndian<quint32>(( quint32(t.d_lineNr) << RowCol::COL_BIT_LEN ) | t.d_colNr, rec + 4);
+    qToLittleEndian<quint32>(t.d_val.isEmpty() ? quint32(SynTreeReader::NoValue) :
+                                                 intern(d_strIds, d_strs, t.d_val), rec + 8);
+    qToLittleEndian<quint32>(sizes[index++], rec + 12);
+    if( d_out->write((const char*)rec, s_recordLen) != s_recordLen )
+        return error("cannot write node");
+    foreach( SynTree* sub, node->d_children )
+        if( !writeNode(sub, sizes, index) )
+            return false;
+    return true;
+}
+
+bool SynTreeWriter::writeTable(const QList<QByteArray>& strs)
+{
+    QByteArray offs(( strs.size() + 2 ) * 4, 0);
+    uchar* p = (uchar*)offs.data();
+    qToLittleEndian<quint32>(strs.size(), p);
+    quint32 off = 0;
+    for( int i = 0; i < strs.size(); i++ )
+    {
+        qToLittleEndian<quint32>(off, p + 4 + i * 4);
+        off += strs[i].size();
+    }
+    qToLittleEndian<quint32>(off, p + 4 + strs.size() * 4);
+    if( d_out->write(offs) != offs.size() )
+        return error("cannot write string table");
+    foreach( const QByteArray& str, strs )
+        if( d_out->write(str) != str.size() )
+            return error("cannot write string table");
+    return true;
+}
+
+quint32 SynTreeWriter::intern(QHash<QByteArray, quint32>& ids, QList<QByteArray>& strs, const QByteArray& str)
+{
+    QHash<QByteArray, quint32>::const_iterator i = ids.find(str);
+    if( i != ids.end() )
+        return i.value();
+    const quint32 id = strs.size();
+    ids.insert(str,id);
+    strs.append(str);
+    return id;
+}
+
+bool SynTreeWriter::error(const QString& msg)
+{
+    d_error = msg;
+    return false;
+}
+
+SynTreeReader::SynTreeReader():d_file(0),d_data(0),d_size(0),d_nodeCount(0),
+    d_strCount(0),d_strOffs(0),d_strData(0),d_strLen(0),d_pathCount(0),d_pathOffs(0),d_pathData(0),d_pathLen(0)
+{
+}
+
+SynTreeReader::~SynTreeReader()
+{
+    close();
+}
+
+bool SynTreeReader::open(const QString& path)
+{
+    close();
+    d_file = new QFile(path);
+    if( !d_file->open(QIODevice::ReadOnly) )
+        return error(QString("cannot open file %1").arg(path));
+    d_size = d_file->size();
+    if( d_size < s_headerLen )
+        return error("file too short");
+    d_data = d_file->map(0,d_size);
+    if( d_data == 0 )
+        return error(QString("cannot map file %1").arg(path));
+    if( ::memcmp(d_data, s_magic, 4) != 0 )
+        return error("not a syntax tree file");
+    if( qFromLittleEndian<quint32>(d_data + 4) != SynTreeWriter::Version )
+        return error("incompatible syntax tree file version");
+    d_nodeCount = qFromLittleEndian<quint32>(d_data + 8);
+    if( d_nodeCount == 0 || s_headerLen + quint64(d_nodeCount) * s_recordLen > d_size )
+        return error("invalid node count");
+    if( !readTable(qFromLittleEndian<quint32>(d_data + 12), d_strCount, d_strOffs, d_strData, d_strLen) ||
+            !readTable(qFromLittleEndian<quint32>(d_data + 16), d_pathCount, d_pathOffs, d_pathData, d_pathLen) )
+        return false;
+    return true;
+}
+
+void SynTreeReader::close()
+{
+    if( d_file )
+        delete d_file; // also unmaps
+    d_file = 0;
+    d_data = 0;
+    d_size = 0;
+    d_nodeCount = 0;
+    d_strCount = 0;
+    d_strLen = 0;
+    d_pathCount = 0;
+    d_pathLen = 0;
+    d_pathCache.clear();
+}
+
+quint16 SynTreeReader::getType(quint32 node) const
+{
+    return qFromLittleEndian<quint16>(record(node));
+}
+
+RowCol SynTreeReader::getLoc(quint32 node) const
+{
+    const quint32 rc = qFromLittleEndian<quint32>(record(node) + 4);
+    return RowCol(rc >> RowCol::COL_BIT_LEN, rc & ( ( 1 << RowCol::COL_BIT_LEN ) - 1 ));
+}
+
+QByteArray SynTreeReader::getValue(quint32 node) const
+{
+    const quint32 i = qFromLittleEndian<quint32>(record(node) + 8);
+    return tableEntry(d_strOffs, d_strData, d_strCount, d_strLen, i);
+}
+
+QString SynTreeReader::getPath(quint32 node) const
+{
+    const quint32 i = qFromLittleEndian<quint16>(record(node) + 2);
+    if( i >= d_pathCount )
+        return QString();
+    QHash<quint32,QString>::const_iterator j = d_pathCache.find(i);
+    if( j != d_pathCache.end() )
+        return j.value();
+    const QString path = QString::fromUtf8(tableEntry(d_pathOffs, d_pathData, d_pathCount, d_pathLen, i));
+    d_pathCache.insert(i,path);
+    return path;
+}
+
+quint32 SynTreeReader::getSubtreeSize(quint32 node) const
+{
+    return qFromLittleEndian<quint32>(record(node) + 12);
+}
+
+SynTree*SynTreeReader::toSynTree() const
+{
+    if( d_nodeCount == 0 )
+        return 0;
+    quint32 node = 0;
+    return toSynTree(node);
+}
+
+const uchar*SynTreeReader::record(quint32 node) const
+{
+    Q_ASSERT( node < d_nodeCount );
+    return d_data + s_headerLen + node * s_recordLen;
+}
+
+bool SynTreeReader::readTable(quint32 off, quint32& count, const uchar*& offsets, const uchar*& data, quint32& len)
+{
+    if( quint64(off) + 4 > d_size )
+        return error("invalid table offset");
+    count = qFromLittleEndian<quint32>(d_data + off);
+    offsets = d_data + off + 4;
+    data = offsets + ( quint64(count) + 1 ) * 4;
+    if( data > d_data + d_size )
+        return error("invalid table size");
+    len = qFromLittleEndian<quint32>(offsets + count * 4);
+    if( quint64(len) > quint64( d_data + d_size - data ) )
+        return error("invalid table size");
+    return true;
+}
+
+QByteArray SynTreeReader::tableEntry(const uchar* offsets, const uchar* data, quint32 count, quint32 len,
+                                     quint32 i) const
+{
+    // only the last offset is checked by readTable, a damaged file can have any others
+    if( i >= count )
+        return QByteArray();
+    const quint32 from = qFromLittleEndian<quint32>(offsets + i * 4);
+    const quint32 to = qFromLittleEndian<quint32>(offsets + i * 4 + 4);
+    if( from > to || to > len )
+        return QByteArray();
+    return QByteArray::fromRawData((const char*)data + from, to - from);
+}
+
+SynTree*SynTreeReader::toSynTree(quint32& node) const
+{
+    const quint16 type = getType(node);
+    const RowCol loc = getLoc(node);
+    Token t(type, loc.d_row, loc.d_col);
+    const QByteArray val = getValue(node);
+    if( !val.isEmpty() )
+    {
+        t.d_val = QByteArray(val.constData(), val.size()); // detach from the mapping
+        t.d_len = qMin(val.size(), 255);
+        if( type == Tok_identifier )
+            t.d_id = Token::toId(t.d_val);
+    }else if( type < SynTree::R_First && type != Tok_Invalid && type != Tok_Eof )
+        t.d_len = ::strlen(tokenTypeString(type));
+    t.d_sourcePath = getPath(node);
+    SynTree* res = new SynTree(t);
+    const quint32 end = getNextSibling(node);
+    node++;
+    while( node < end && node < d_nodeCount )
+        res->d_children.append(toSynTree(node));
+    return res;
+}
+
+bool SynTreeReader::error(const QString& msg)
+{
+    d_error = msg;
+    return false;
+}
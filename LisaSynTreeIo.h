@@ -0,0 +1,101 @@
+#ifndef LISASYNTREEIO_H
+#define LISASYNTREEIO_H
+
+/*
+** Copyright (C) 2023 Rochus Keller (me@rochus-keller.ch)
+**
+** This file is part of the LisaPascal project.
+**
+** $QT_BEGIN_LICENSE:LGPL21$
+** GNU Lesser General Public License Usage
+** This file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 or version 3 as published by the Free
+** Software Foundation and appearing in the file LICENSE.LGPLv21 and
+** LICENSE.LGPLv3 included in the packaging of this file. Please review the
+** following information to ensure the GNU Lesser General Public License
+** requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+** http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*/
+
+#include <LisaPascal/LisaSynTree.h>
+#include <QHash>
+#include <QVector>
+
+class QIODevice;
+class QFile;
+
+namespace Lisa
+{
+// Binary syntax tree format, all numbers little endian:
+//   header:  "LPST", u32 version, u32 nodeCount, u32 offset of string table, u32 offset of path table
+//   nodes:   nodeCount records of 16 bytes in preorder:
+//            u16 type, u16 path index, u32 row << 13 | col, u32 value index or NoValue,
+//            u32 number of nodes in the subtree below this node
+//   tables:  u32 count, u32 offsets[count + 1] relative to the end of the offset array, utf8 bytes
+class SynTreeWriter
+{
+public:
+    enum { Version = 1 };
+    explicit SynTreeWriter(QIODevice* out);
+    bool write( const SynTree* root );
+    const QString& getError() const { return d_error; }
+protected:
+    quint32 countNodes( const SynTree*, QVector<quint32>& sizes );
+    bool writeNode( const SynTree*, const QVector<quint32>& sizes, quint32& index );
+    bool writeTable( const QList<QByteArray>& );
+    quint32 intern( QHash<QByteArray,quint32>&, QList<QByteArray>&, const QByteArray& );
+    bool error( const QString& );
+private:
+    QIODevice* d_out;
+    QHash<QByteArray,quint32> d_strIds;
+    QList<QByteArray> d_strs;
+    QHash<QByteArray,quint32> d_pathIds;
+    QList<QByteArray> d_paths;
+    QString d_error;
+};
+
+class SynTreeReader
+{
+public:
+    enum { NoValue = 0xffffffff };
+    SynTreeReader();
+    ~SynTreeReader();
+    bool open( const QString& path );
+    void close();
+    const QString& getError() const { return d_error; }
+
+    // random access to the mapped records; node 0 is the root
+    quint32 getNodeCount() const { return d_nodeCount; }
+    quint16 getType( quint32 node ) const;
+    RowCol getLoc( quint32 node ) const;
+    QByteArray getValue( quint32 node ) const; // refers to the mapped file, valid until close()
+    QString getPath( quint32 node ) const;
+    quint32 getSubtreeSize( quint32 node ) const;
+    quint32 getNextSibling( quint32 node ) const { return node + 1 + getSubtreeSize(node); }
+
+    SynTree* toSynTree() const; // caller owns
+protected:
+    const uchar* record( quint32 node ) const;
+    bool readTable( quint32 off, quint32& count, const uchar*& offsets, const uchar*& data, quint32& len );
+    QByteArray tableEntry( const uchar* offsets, const uchar* data, quint32 count, quint32 len, quint32 i ) const;
+    SynTree* toSynTree( quint32& node ) const;
+    bool error( const QString& );
+private:
+    QFile* d_file;
+    const uchar* d_data;
+    quint32 d_size;
+    quint32 d_nodeCount;
+    quint32 d_strCount;
+    const uchar* d_strOffs;
+    const uchar* d_strData;
+    quint32 d_strLen;
+    quint32 d_pathCount;
+    const uchar* d_pathOffs;
+    const uchar* d_pathData;
+    quint32 d_pathLen;
+    mutable QHash<quint32,QString> d_pathCache;
+    QString d_error;
+};
+}
+
+#endif // LISASYNTREEIO_H
@@ -17,21 +17,35 @@
 
 #include "LisaToken.h"
 #include <QHash>
+#include <QReadWriteLock>
 #include <QtDebug>
 
 static quint32 s_maxId = 0;
-static QHash<QByteArray,quint16> s_dir;
+static QHash<QByteArray,quint32> s_dir;
+static QReadWriteLock s_lock;
 
-
-quint16 Lisa::Token::toId(const QByteArray& ident)
+quint32 Lisa::Token::toId(const QByteArray& ident)
 {
-    quint16& id = s_dir[ ident.toLower() ];
+    // Pascal is case insensitive, so all spellings of an ident get the same id
+    const QByteArray lc = ident.toLower();
+    // atoms never change, so each thread keeps the ones it has seen and only takes the lock on a miss;
+    // parser threads would otherwise serialize on s_lock for every identifier
+    static thread_local QHash<QByteArray,quint32> cache;
+    quint32 id = cache.value(lc);
+    if( id != 0 )
+        return id;
+    {
+        QReadLocker lock(&s_lock);
+        id = s_dir.value(lc);
+    }
     if( id == 0 )
     {
-        if( ++s_maxId > 0xffff )
-            qWarning() << "Lisa::Token::toId: run out of IDs, required" << s_maxId;
-        else
-            id = s_maxId;
+        QWriteLocker lock(&s_lock);
+        quint32& atom = s_dir[ lc ];
+        if( atom == 0 )
+            atom = ++s_maxId;
+        id = atom;
     }
+    cache.insert(lc,id);
     return id;
 }
@@ -36,7 +36,7 @@ namespace Lisa
         quint8 d_type; // TokenType
 #endif
         quint8 d_len;
-        quint16 d_id;
+        quint32 d_id; // atom of case folded identifiers, see toId
         quint32 d_lineNr : RowCol::ROW_BIT_LEN;
         quint32 d_colNr : RowCol::COL_BIT_LEN;
         QString d_sourcePath;
@@ -47,7 +47,7 @@ namespace Lisa
         bool isValid() const { return d_type != Tok_Eof && d_type != Tok_Invalid; }
         RowCol toLoc() const { return RowCol(d_lineNr,d_colNr); }
 
-        static quint16 toId(const QByteArray& ident);
+        static quint32 toId(const QByteArray& ident); // thread-safe
     };
 }
 
@@ -20,7 +20,7 @@
 #include <QtDebug>
 using namespace Lisa;
 
-PpLexer::PpLexer(FileSystem* fs):d_fs(fs),d_sloc(0)
+PpLexer::PpLexer(FileSystem* fs):d_fs(fs),d_sloc(0),d_collectComments(false)
 {
     Q_ASSERT(fs);
 }
@@ -34,29 +34,94 @@ PpLexer::~PpLexer()
 bool PpLexer::reset(const QString& filePath)
 {
     d_stack.clear();
+    d_stackFiles.clear();
     d_buffer.clear();
     for( int i = 0; i < d_files.size(); i++ )
         delete d_files[i];
     d_files.clear();
     d_sloc = 0;
     d_includes.clear();
+    d_comments.clear();
 
     const FileSystem::File* f = d_fs->findFile(filePath);
     if( f == 0 )
         return false;
+    QIODevice* file = d_fs->openFile(f);
+    if( file == 0 )
+        return false;
     d_stack.push_back(Lexer());
     d_stack.back().setIgnoreComments(false);
-    QFile* file = new QFile(filePath);
-    if( !file->open(QIODevice::ReadOnly) )
-    {
-        delete file;
-        d_stack.pop_back();
+    d_stack.back().setStream(file,filePath);
+    d_stackFiles.push_back(f);
+    return true;
+}
+
+bool PpLexer::saveState(PpLexer::State& s, const Token& next) const
+{
+    if( !d_buffer.isEmpty() || d_stack.isEmpty() || d_stack.back().getFilePath() != next.d_sourcePath )
         return false;
+    s.d_levels.clear();
+    for( int i = 0; i < d_stack.size(); i++ )
+    {
+        State::Level l;
+        l.d_path = d_stack[i].getFilePath();
+        l.d_line = d_stack[i].getLineNr();
+        l.d_col = d_stack[i].getColNr();
+        s.d_levels.append(l);
     }
-    d_stack.back().setStream(file,filePath);
+    // the innermost lexer resumes at the start of next, not behind it
+    s.d_levels.back().d_line = next.d_lineNr;
+    s.d_levels.back().d_col = next.d_colNr - 1;
+    s.d_ppVars = d_ppVars;
+    s.d_conditionStack = d_conditionStack;
     return true;
 }
 
+bool PpLexer::restoreState(const PpLexer::State& s)
+{
+    for( int i = 0; i < d_stack.size(); i++ )
+        delete d_stack[i].getDevice();
+    d_stack.clear();
+    d_stackFiles.clear();
+    d_buffer.clear();
+    d_sloc = 0;
+    d_includes.clear();
+    d_comments.clear();
+    d_ppVars = s.d_ppVars;
+    d_conditionStack = s.d_conditionStack;
+    foreach( const State::Level& l, s.d_levels )
+    {
+        const FileSystem::File* f = d_fs->findFile(l.d_path);
+        if( f == 0 )
+            return false;
+        QIODevice* file = d_fs->openFile(f);
+        if( file == 0 )
+            return false;
+        d_stack.push_back(Lexer());
+        d_stack.back().setIgnoreComments(false);
+        d_stack.back().setStream(file,l.d_path);
+        d_stackFiles.push_back(f);
+        if( !d_stack.back().setPos(l.d_line, l.d_col) )
+            return false;
+    }
+    return !d_stack.isEmpty();
+}
+
+void PpLexer::replay(const QList<Token>& toks)
+{
+    for( int i = 0; i < d_stack.size(); i++ )
+        delete d_stack[i].getDevice();
+    d_stack.clear();
+    d_stackFiles.clear();
+    d_sloc = 0;
+    d_includes.clear();
+    d_comments.clear();
+    d_buffer.clear();
+    d_buffer.reserve(toks.size());
+    foreach( const Token& t, toks )
+        d_buffer.append(t); // own copy so consumption doesn't detach
+}
+
 Token PpLexer::nextToken()
 {
     Token t;
@@ -95,6 +160,7 @@ Token PpLexer::nextTokenImp()
             delete d_stack.back().getDevice();
             d_sloc += d_stack.back().getSloc();
             d_stack.pop_back();
+            d_stackFiles.pop_back();
             if( d_stack.isEmpty() )
                 return Token(Tok_Eof);
         }
@@ -119,7 +185,8 @@ Token PpLexer::nextTokenImp()
                 err.d_sourcePath = t.d_sourcePath;
                 return err;
             }
-        }
+        }else if( t.d_type == Tok_Comment && d_collectComments && ppthis().open )
+            addComment(t);
         if( !ppthis().open )
         {
             t = d_stack.back().peekToken();
@@ -134,6 +201,21 @@ Token PpLexer::nextTokenImp()
     return t;
 }
 
+void PpLexer::addComment(const Token& t)
+{
+    // called right after the lexer delivered t
+    const Lexer& lex = d_stack.back();
+    Comments& list = d_comments[t.d_sourcePath];
+    Comment c;
+    c.d_pos = lex.getTokenOffset();
+    c.d_len = lex.getOffset() - c.d_pos;
+    c.d_loc = t.toLoc();
+    c.d_endRow = lex.getLineNr();
+    if( !list.isEmpty() && list.last().d_pos >= c.d_pos )
+        return; // file included more than once
+    list.append(c);
+}
+
 class PpMiniLex
 {
 public:
@@ -217,22 +299,11 @@ PpLexer::PpSym PpLexer::checkPp(QByteArray& str)
 
 bool PpLexer::handleInclude(const QByteArray& data, const Token& t)
 {
-    QString path = QString::fromUtf8(data).trimmed().toLower();
-    if( path.endsWith(".text") )
-        path.chop(5);
-    const FileSystem::File* f = d_fs->findFile(t.d_sourcePath);
-    Q_ASSERT( f );
-    QStringList pathFile = path.split('/');
-    const FileSystem::File* found = 0;
-    if( pathFile.size() == 1 )
-    {
-        QString name = pathFile[0];
-        const int colon = name.indexOf(':');
-        if( colon != -1 )
-            name = name.mid(colon+1);
-        found = d_fs->findFile(f->d_dir, QString(), name);
-    }else if( pathFile.size() == 2 )
-        found = d_fs->findFile(f->d_dir, pathFile[0], pathFile[1]);
+    // t was delivered by the innermost lexer
+    const FileSystem::File* f = d_stackFiles.back();
+    Q_ASSERT( f && f->d_realPath == t.d_sourcePath );
+    QByteArray content;
+    const FileSystem::File* found = d_fs->findInclude(f->d_dir, data, &content);
     if( found == 0 )
     {
         d_err = QString("include file '%1' not found").arg(data.constData()).toUtf8();
@@ -241,22 +312,25 @@ bool PpLexer::handleInclude(const QByteArray& data, const Token& t)
     {
         Include inc;
         inc.d_file = found;
+        inc.d_includer = f;
+        inc.d_directive = data;
         inc.d_loc.d_row = t.d_lineNr;
         inc.d_loc.d_col = t.d_colNr;
         inc.d_len = t.d_val.size();
         d_includes.append(inc);
-        d_stack.push_back(Lexer());
-        d_stack.back().setIgnoreComments(false);
-        QFile* file = new QFile(found->d_realPath);
-        if( !file->open(QIODevice::ReadOnly) )
+        if( content.isNull() )
         {
-            delete file;
-            d_stack.pop_back();
             d_err = QString("file '%1' cannot be opened").arg(data.constData()).toUtf8();
             return false;
         }
+        d_stack.push_back(Lexer());
+        d_stack.back().setIgnoreComments(false);
+        QBuffer* file = new QBuffer();
+        file->setData(content);
+        file->open(QIODevice::ReadOnly);
         //qDebug() << "including:" << path; // TEST
         d_stack.back().setStream(file,found->d_realPath);
+        d_stackFiles.push_back(found);
     }
     return true;
 }
@@ -20,6 +20,7 @@
 #include "FileSystem.h"
 #include "LisaLexer.h"
 #include "LisaRowCol.h"
+#include <QVector>
 
 class QIODevice;
 
@@ -35,10 +36,39 @@ public:
     struct Include
     {
         const FileSystem::File* d_file;
+        const FileSystem::File* d_includer;
+        QByteArray d_directive; // argument of $I
         RowCol d_loc;
         quint16 d_len;
     };
+    struct ppstatus
+    {
+        bool open; // this is the open condition which renders tokens
+        bool openSeen; // at least one true condition seen
+        bool elseSeen; // there was already an else part
+        ppstatus(bool o = true):open(o),openSeen(false),elseSeen(false){}
+    };
 
+    struct Comment
+    {
+        quint32 d_pos; // byte offset in the source file
+        quint32 d_len;
+        RowCol d_loc;
+        quint32 d_endRow;
+    };
+    typedef QVector<Comment> Comments; // ordered by d_pos
+    struct State
+    {
+        struct Level
+        {
+            QString d_path;
+            quint32 d_line;
+            quint16 d_col;
+        };
+        QList<Level> d_levels; // include stack, innermost last
+        PpVars d_ppVars;
+        QList<ppstatus> d_conditionStack;
+    };
 
     PpLexer(FileSystem*);
     ~PpLexer();
@@ -49,6 +79,15 @@ public:
     Token peekToken(quint8 lookAhead = 1);
     quint32 getSloc() const { return d_sloc; }
     const QList<Include>& getIncludes() const { return d_includes; }
+
+    // snapshot so that scanning can later resume at token 'next', which must be the last token delivered
+    bool saveState( State&, const Token& next ) const;
+    bool restoreState( const State& );
+    void replay( const QList<Token>& ); // deliver the given tokens instead of scanning files
+
+    // record the position of all non-directive comments per source file
+    void setCollectComments( bool on ) { d_collectComments = on; }
+    const QHash<QString,Comments>& getComments() const { return d_comments; }
 protected:
     Token nextTokenImp();
     static PpSym checkPp(QByteArray&);
@@ -57,16 +96,9 @@ protected:
     bool handleIfc(const QByteArray& data);
     bool handleElsec();
     bool handleEndc();
+    void addComment( const Token& );
     bool error( const QString& msg);
 
-    struct ppstatus
-    {
-        bool open; // this is the open condition which renders tokens
-        bool openSeen; // at least one true condition seen
-        bool elseSeen; // there was already an else part
-        ppstatus(bool o = true):open(o),openSeen(false),elseSeen(false){}
-    };
-
     ppstatus ppouter()
     {
         ppstatus res;
@@ -96,6 +128,7 @@ protected:
 private:
     FileSystem* d_fs;
     QList<Lexer> d_stack;
+    QList<const FileSystem::File*> d_stackFiles; // the file scanned by each lexer in d_stack
     QList<QIODevice*> d_files;
     QList<Token> d_buffer;
     QString d_err;
@@ -103,6 +136,8 @@ private:
     PpVars d_ppVars;
     QList<ppstatus> d_conditionStack;
     QList<Include> d_includes;
+    QHash<QString,Comments> d_comments;
+    bool d_collectComments;
 };
 }
 
@@ -19,8 +19,10 @@
 #include <QFile>
 #include <QtDebug>
 #include <QCryptographicHash>
+#include <QElapsedTimer>
 #include "PpLexer.h"
 #include "LisaParser.h"
+#include "LisaSynTreeIo.h"
 #include "Converter.h"
 #include "FileSystem.h"
 using namespace Lisa;
@@ -56,6 +58,40 @@ static void dump(QTextStream& out, const SynTree* node, int level)
         dump( out, sub, level + 1 );
 }
 
+static bool saveTree(const QString& path, const SynTree* root)
+{
+    QFile out(path);
+    if( !out.open(QIODevice::WriteOnly) )
+    {
+        qCritical() << "cannot open file for writing:" << path;
+        return false;
+    }
+    SynTreeWriter w(&out);
+    if( !w.write(root) )
+    {
+        qCritical() << "cannot write" << path << w.getError();
+        return false;
+    }
+    return true;
+}
+
+static void loadTree(const QString& path)
+{
+    QElapsedTimer t;
+    t.start();
+    SynTreeReader r;
+    if( !r.open(path) )
+    {
+        qCritical() << "cannot load" << path << r.getError();
+        return;
+    }
+    SynTree* root = r.toSynTree();
+    qDebug() << "loaded" << r.getNodeCount() << "nodes in" << t.elapsed() << "[ms]";
+    QTextStream out(stdout);
+    dump(out,root,0);
+    delete root;
+}
+
 static void compareFiles( const QStringList& files, int off )
 {
     foreach( const QString& f, files )
@@ -106,13 +142,14 @@ static void checkDir( const QStringList& files, int off)
     }
 }
 
-static void runParser(const QString& root)
+static void runParser(const QString& root, bool save)
 {
     FileSystem fs;
     fs.load(root);
     // fs.getRoot().dump();
 
     QList<const FileSystem::File*> files = fs.getAllPas();
+    fs.prefetch(files);
     int ok = 0;
     foreach( const FileSystem::File* file, files )
     {
@@ -139,11 +176,14 @@ static void runParser(const QString& root)
         QTextStream s(&out);
         dump(s,&p.d_root,0);
 #endif
+        if( save )
+            saveTree(file->d_realPath + ".stb", &p.d_root);
     }
     qDebug() << "#### finished with" << ok << "files ok of total" << files.size() << "files";
+    qDebug() << "include resolution:" << fs.getIncludeHits() << "hits," << fs.getIncludeMisses() << "misses";
 }
 
-static void runParser(const QString& root, const QString& path)
+static void runParser(const QString& root, const QString& path, bool save)
 {
     FileSystem fs;
     fs.load(root);
@@ -169,6 +209,64 @@ static void runParser(const QString& root, const QString& path)
     QTextStream s(&out);
     dump(s,&p.d_root,0);
 #endif
+    if( save )
+        saveTree(path + ".stb", &p.d_root);
+}
+
+static void runPacker(const QString& root, const QString& out)
+{
+    FileSystem fs;
+    if( !fs.load(root) )
+    {
+        qCritical() << fs.getError();
+        return;
+    }
+    if( !fs.writeArchive(out) )
+        qCritical() << "cannot write archive" << out;
+    else
+        qDebug() << "packed" << fs.getFileCount() << "files to" << out;
+}
+
+static void runBench(const QString& root, const QString& filter)
+{
+    FileSystem fs;
+    fs.load(root);
+
+    // preprocess and lex everything in advance so only the parser is measured
+    QList< QList<Token> > units;
+    quint64 count = 0;
+    foreach( const FileSystem::File* file, fs.getAllPas() )
+    {
+        if( !filter.isEmpty() && !file->getVirtualPath().contains(filter, Qt::CaseInsensitive) )
+            continue;
+        PpLexer lex(&fs);
+        lex.reset(file->d_realPath);
+        QList<Token> toks;
+        Token t = lex.nextToken();
+        while( t.d_type != Tok_Eof )
+        {
+            toks.append(t);
+            t = lex.nextToken();
+        }
+        count += toks.size();
+        units.append(toks);
+    }
+
+    QElapsedTimer timer;
+    qint64 ns = 0;
+    foreach( const QList<Token>& toks, units )
+    {
+        PpLexer lex(&fs);
+        lex.replay(toks);
+        Parser p(&lex);
+        timer.start();
+        p.RunParser();
+        ns += timer.nsecsElapsed();
+    }
+    if( ns == 0 )
+        ns = 1;
+    qDebug() << "parsed" << count << "tokens of" << units.size() << "files in" << ns / 1000000 << "[ms],"
+             << qint64( count * 1e9 / ns ) << "tokens/s";
 }
 
 static void checkTokens(const QStringList& files)
@@ -295,11 +393,42 @@ int main(int argc, char *argv[])
     //checkFileNames(files);
     //checkTokens(files);
 #else
-    QFileInfo info(a.arguments()[1]);
-    if( info.isDir() )
-        runParser(a.arguments()[1]);
+    // -save: also write each parse tree in binary format to <file>.stb
+    // -load <file>.stb: read a binary parse tree and dump it to stdout
+    // -bench <dir>: measure parser throughput on pre-lexed tokens
+    // -only <text>: restrict -bench to units whose virtual path contains text, e.g. libfp
+    // -pack <file> <dir>: write all Pascal files of dir to a single archive which can be used instead of dir
+    bool save = false, load = false, bench = false;
+    QString path, filter, pack;
+    for( int i = 1; i < a.arguments().size(); i++ )
+    {
+        const QString arg = a.arguments()[i];
+        if( arg == "-save" )
+            save = true;
+        else if( arg == "-load" )
+            load = true;
+        else if( arg == "-bench" )
+            bench = true;
+        else if( arg == "-only" && i + 1 < a.arguments().size() )
+            filter = a.arguments()[++i];
+        else if( arg == "-pack" && i + 1 < a.arguments().size() )
+            pack = a.arguments()[++i];
+        else
+            path = arg;
+    }
+    if( path.isEmpty() )
+        return -1;
+    QFileInfo info(path);
+    if( load )
+        loadTree(info.absoluteFilePath());
+    else if( !pack.isEmpty() )
+        runPacker(info.absoluteFilePath(), pack);
+    else if( bench )
+        runBench(info.absoluteFilePath(), filter);
+    else if( info.isDir() || FileSystem::isArchive(path) )
+        runParser(path, save);
     else
-        runParser(info.absolutePath(),info.absoluteFilePath());
+        runParser(info.absolutePath(),info.absoluteFilePath(), save);
 #endif
 
     return 0;